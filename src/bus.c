@@ -0,0 +1,383 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "bus.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+/* Scalar versions, also used for the remainder after the SIMD loops */
+
+static void _add_int16(int32_t *bus, const int16_t *src, int samples)
+{
+	while(samples--)
+	{
+		*(bus++) += *(src++);
+	}
+}
+
+static void _add_int32(int32_t *bus, const int32_t *src, int samples)
+{
+	while(samples--)
+	{
+		*(bus++) += *(src++);
+	}
+}
+
+static void _saturate(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats)
+{
+	int32_t v, a;
+	
+	while(samples--)
+	{
+		v = *(bus++);
+		a = abs(v);
+		
+		if(a > stats->peak) stats->peak = a;
+		
+		if(v > INT16_MAX)
+		{
+			v = INT16_MAX;
+			stats->clipped++;
+		}
+		else if(v < INT16_MIN)
+		{
+			v = INT16_MIN;
+			stats->clipped++;
+		}
+		
+		*(dst++) = v;
+	}
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void _add_int16_avx2(int32_t *bus, const int16_t *src, int samples)
+{
+	__m256i a, b;
+	
+	for(; samples >= 16; samples -= 16, bus += 16, src += 16)
+	{
+		a = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) src));
+		b = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (src + 8)));
+		
+		a = _mm256_add_epi32(a, _mm256_loadu_si256((const __m256i *) bus));
+		b = _mm256_add_epi32(b, _mm256_loadu_si256((const __m256i *) (bus + 8)));
+		
+		_mm256_storeu_si256((__m256i *) bus, a);
+		_mm256_storeu_si256((__m256i *) (bus + 8), b);
+	}
+	
+	_add_int16(bus, src, samples);
+}
+
+__attribute__((target("avx2")))
+static void _add_int32_avx2(int32_t *bus, const int32_t *src, int samples)
+{
+	__m256i a;
+	
+	for(; samples >= 8; samples -= 8, bus += 8, src += 8)
+	{
+		a = _mm256_add_epi32(
+			_mm256_loadu_si256((const __m256i *) bus),
+			_mm256_loadu_si256((const __m256i *) src)
+		);
+		
+		_mm256_storeu_si256((__m256i *) bus, a);
+	}
+	
+	_add_int32(bus, src, samples);
+}
+
+__attribute__((target("avx2")))
+static void _saturate_avx2(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats)
+{
+	const __m256i max = _mm256_set1_epi32(INT16_MAX);
+	const __m256i min = _mm256_set1_epi32(INT16_MIN);
+	__m256i a, b, peak, clip;
+	int32_t p[8];
+	int i;
+	
+	peak = _mm256_setzero_si256();
+	clip = _mm256_setzero_si256();
+	
+	for(; samples >= 16; samples -= 16, bus += 16, dst += 16)
+	{
+		a = _mm256_loadu_si256((const __m256i *) bus);
+		b = _mm256_loadu_si256((const __m256i *) (bus + 8));
+		
+		peak = _mm256_max_epi32(peak, _mm256_abs_epi32(a));
+		peak = _mm256_max_epi32(peak, _mm256_abs_epi32(b));
+		
+		/* Each clipped sample subtracts one (-1) from its counter lane */
+		clip = _mm256_add_epi32(clip, _mm256_cmpgt_epi32(a, max));
+		clip = _mm256_add_epi32(clip, _mm256_cmpgt_epi32(min, a));
+		clip = _mm256_add_epi32(clip, _mm256_cmpgt_epi32(b, max));
+		clip = _mm256_add_epi32(clip, _mm256_cmpgt_epi32(min, b));
+		
+		/* Pack with saturation, then undo the per-lane interleave */
+		a = _mm256_permute4x64_epi64(_mm256_packs_epi32(a, b), 0xD8);
+		_mm256_storeu_si256((__m256i *) dst, a);
+	}
+	
+	_mm256_storeu_si256((__m256i *) p, peak);
+	for(i = 0; i < 8; i++)
+	{
+		if(p[i] > stats->peak) stats->peak = p[i];
+	}
+	
+	_mm256_storeu_si256((__m256i *) p, clip);
+	for(i = 0; i < 8; i++)
+	{
+		stats->clipped -= p[i];
+	}
+	
+	_saturate(dst, bus, samples, stats);
+}
+
+#endif
+
+#ifdef __SSE2__
+
+static void _add_int16_sse2(int32_t *bus, const int16_t *src, int samples)
+{
+	__m128i s, a, b;
+	
+	for(; samples >= 8; samples -= 8, bus += 8, src += 8)
+	{
+		/* Sign extend to 32-bits */
+		s = _mm_loadu_si128((const __m128i *) src);
+		a = _mm_srai_epi32(_mm_unpacklo_epi16(s, s), 16);
+		b = _mm_srai_epi32(_mm_unpackhi_epi16(s, s), 16);
+		
+		a = _mm_add_epi32(a, _mm_loadu_si128((const __m128i *) bus));
+		b = _mm_add_epi32(b, _mm_loadu_si128((const __m128i *) (bus + 4)));
+		
+		_mm_storeu_si128((__m128i *) bus, a);
+		_mm_storeu_si128((__m128i *) (bus + 4), b);
+	}
+	
+	_add_int16(bus, src, samples);
+}
+
+static void _add_int32_sse2(int32_t *bus, const int32_t *src, int samples)
+{
+	__m128i a;
+	
+	for(; samples >= 4; samples -= 4, bus += 4, src += 4)
+	{
+		a = _mm_add_epi32(
+			_mm_loadu_si128((const __m128i *) bus),
+			_mm_loadu_si128((const __m128i *) src)
+		);
+		
+		_mm_storeu_si128((__m128i *) bus, a);
+	}
+	
+	_add_int32(bus, src, samples);
+}
+
+static void _saturate_sse2(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats)
+{
+	const __m128i max = _mm_set1_epi32(INT16_MAX);
+	const __m128i min = _mm_set1_epi32(INT16_MIN);
+	__m128i a, b, m, peak, clip;
+	int32_t p[4];
+	int i;
+	
+	peak = _mm_setzero_si128();
+	clip = _mm_setzero_si128();
+	
+	for(; samples >= 8; samples -= 8, bus += 8, dst += 8)
+	{
+		a = _mm_loadu_si128((const __m128i *) bus);
+		b = _mm_loadu_si128((const __m128i *) (bus + 4));
+		
+		/* SSE2 has no abs or max for 32-bit integers. The absolute
+		 * value is taken as (x ^ sign) - sign, and the maximum by
+		 * comparing and masking */
+		m = _mm_srai_epi32(a, 31);
+		m = _mm_sub_epi32(_mm_xor_si128(a, m), m);
+		m = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(m, peak), m), _mm_andnot_si128(_mm_cmpgt_epi32(m, peak), peak));
+		peak = m;
+		
+		m = _mm_srai_epi32(b, 31);
+		m = _mm_sub_epi32(_mm_xor_si128(b, m), m);
+		m = _mm_or_si128(_mm_and_si128(_mm_cmpgt_epi32(m, peak), m), _mm_andnot_si128(_mm_cmpgt_epi32(m, peak), peak));
+		peak = m;
+		
+		/* Each clipped sample subtracts one (-1) from its counter lane */
+		clip = _mm_add_epi32(clip, _mm_cmpgt_epi32(a, max));
+		clip = _mm_add_epi32(clip, _mm_cmpgt_epi32(min, a));
+		clip = _mm_add_epi32(clip, _mm_cmpgt_epi32(b, max));
+		clip = _mm_add_epi32(clip, _mm_cmpgt_epi32(min, b));
+		
+		_mm_storeu_si128((__m128i *) dst, _mm_packs_epi32(a, b));
+	}
+	
+	_mm_storeu_si128((__m128i *) p, peak);
+	for(i = 0; i < 4; i++)
+	{
+		if(p[i] > stats->peak) stats->peak = p[i];
+	}
+	
+	_mm_storeu_si128((__m128i *) p, clip);
+	for(i = 0; i < 4; i++)
+	{
+		stats->clipped -= p[i];
+	}
+	
+	_saturate(dst, bus, samples, stats);
+}
+
+#endif
+
+#ifdef __ARM_NEON
+
+static void _add_int16_neon(int32_t *bus, const int16_t *src, int samples)
+{
+	int16x8_t s;
+	
+	for(; samples >= 8; samples -= 8, bus += 8, src += 8)
+	{
+		s = vld1q_s16(src);
+		vst1q_s32(bus, vaddw_s16(vld1q_s32(bus), vget_low_s16(s)));
+		vst1q_s32(bus + 4, vaddw_s16(vld1q_s32(bus + 4), vget_high_s16(s)));
+	}
+	
+	_add_int16(bus, src, samples);
+}
+
+static void _add_int32_neon(int32_t *bus, const int32_t *src, int samples)
+{
+	for(; samples >= 4; samples -= 4, bus += 4, src += 4)
+	{
+		vst1q_s32(bus, vaddq_s32(vld1q_s32(bus), vld1q_s32(src)));
+	}
+	
+	_add_int32(bus, src, samples);
+}
+
+static void _saturate_neon(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats)
+{
+	const int32x4_t max = vdupq_n_s32(INT16_MAX);
+	const int32x4_t min = vdupq_n_s32(INT16_MIN);
+	int32x4_t a, b;
+	uint32x4_t peak, clip;
+	uint32_t p[4];
+	int i;
+	
+	peak = vdupq_n_u32(0);
+	clip = vdupq_n_u32(0);
+	
+	for(; samples >= 8; samples -= 8, bus += 8, dst += 8)
+	{
+		a = vld1q_s32(bus);
+		b = vld1q_s32(bus + 4);
+		
+		peak = vmaxq_u32(peak, vreinterpretq_u32_s32(vabsq_s32(a)));
+		peak = vmaxq_u32(peak, vreinterpretq_u32_s32(vabsq_s32(b)));
+		
+		/* Each clipped sample subtracts one (-1) from its counter lane */
+		clip = vaddq_u32(clip, vcgtq_s32(a, max));
+		clip = vaddq_u32(clip, vcltq_s32(a, min));
+		clip = vaddq_u32(clip, vcgtq_s32(b, max));
+		clip = vaddq_u32(clip, vcltq_s32(b, min));
+		
+		vst1q_s16(dst, vcombine_s16(vqmovn_s32(a), vqmovn_s32(b)));
+	}
+	
+	vst1q_u32(p, peak);
+	for(i = 0; i < 4; i++)
+	{
+		if((int32_t) p[i] > stats->peak) stats->peak = p[i];
+	}
+	
+	vst1q_u32(p, clip);
+	for(i = 0; i < 4; i++)
+	{
+		stats->clipped -= (int32_t) p[i];
+	}
+	
+	_saturate(dst, bus, samples, stats);
+}
+
+#endif
+
+void bus_add_int16(int32_t *bus, const int16_t *src, int samples)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		_add_int16_avx2(bus, src, samples);
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	_add_int16_sse2(bus, src, samples);
+#elif defined(__ARM_NEON)
+	_add_int16_neon(bus, src, samples);
+#else
+	_add_int16(bus, src, samples);
+#endif
+}
+
+void bus_add_int32(int32_t *bus, const int32_t *src, int samples)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		_add_int32_avx2(bus, src, samples);
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	_add_int32_sse2(bus, src, samples);
+#elif defined(__ARM_NEON)
+	_add_int32_neon(bus, src, samples);
+#else
+	_add_int32(bus, src, samples);
+#endif
+}
+
+void bus_saturate(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats)
+{
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		_saturate_avx2(dst, bus, samples, stats);
+		return;
+	}
+#endif
+#ifdef __SSE2__
+	_saturate_sse2(dst, bus, samples, stats);
+#elif defined(__ARM_NEON)
+	_saturate_neon(dst, bus, samples, stats);
+#else
+	_saturate(dst, bus, samples, stats);
+#endif
+}
+
@@ -0,0 +1,42 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _BUS_H
+#define _BUS_H
+
+#include <stdint.h>
+
+/* The composite bus. Channels are summed into 32-bit samples so many
+ * channels peaking together can't wrap, and the result is saturated
+ * once to 16 bits before the FM modulator */
+
+struct bus_stats_t {
+	
+	/* Largest absolute value seen before saturation */
+	int32_t peak;
+	
+	/* Number of samples clipped */
+	int64_t clipped;
+	
+};
+
+extern void bus_add_int16(int32_t *bus, const int16_t *src, int samples);
+extern void bus_add_int32(int32_t *bus, const int32_t *src, int samples);
+extern void bus_saturate(int16_t *dst, const int32_t *bus, int samples, struct bus_stats_t *stats);
+
+#endif
+
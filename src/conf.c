@@ -239,6 +239,31 @@ conf_t conf_loadfile(const char *filename)
 	return(s);
 }
 
+conf_t conf_loadstr(const char *name, const char *str)
+{
+	size_t l, r;
+	char *s, *p;
+	
+	/* Copy the string, plus one byte for the conf terminator */
+	l = strlen(str);
+	s = malloc(l + 2);
+	if(!s)
+	{
+		perror(name);
+		return(NULL);
+	}
+	
+	memcpy(s, str, l + 1);
+	
+	/* Run the copy through the configuration parser */
+	r = _conf_parse(name, s);
+	
+	p = realloc(s, r);
+	if(p) s = p;
+	
+	return(s);
+}
+
 const char *_conf_find(const conf_t conf, const char *section, int index, const char *key)
 {
 	const char *g, *s;
@@ -61,6 +61,7 @@ typedef char* conf_t;
 */
 
 extern conf_t conf_loadfile(const char *filename);
+extern conf_t conf_loadstr(const char *name, const char *str);
 extern int conf_section_exists(const conf_t conf, const char *section, int index);
 extern int conf_key_exists(const conf_t conf, const char *section, int index, const char *key);
 extern const char *conf_str(const conf_t conf, const char *section, int index, const char *key, const char *defaultval);
@@ -0,0 +1,251 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "control.h"
+
+#ifndef _WIN32
+
+#include <errno.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+
+#define CONTROL_LINE_LEN 4096
+
+static int _wait(struct control_t *s, int fd)
+{
+	struct pollfd p[2];
+	int r;
+	
+	/* Wait for fd to be readable, or for the control to close */
+	p[0].fd = fd;
+	p[0].events = POLLIN;
+	p[1].fd = s->pipe[0];
+	p[1].events = POLLIN;
+	
+	do
+	{
+		r = poll(p, 2, -1);
+	}
+	while(r < 0 && errno == EINTR);
+	
+	if(r < 0 || p[1].revents)
+	{
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void _serve(struct control_t *s, int fd)
+{
+	char line[CONTROL_LINE_LEN];
+	FILE *reply;
+	char *e;
+	int len = 0;
+	int r;
+	
+	reply = fdopen(dup(fd), "w");
+	if(!reply)
+	{
+		return;
+	}
+	
+	/* Stop if the client has gone away. SIGPIPE is ignored,
+	 * so writing to it only sets the error flag */
+	while(!ferror(reply) && _wait(s, fd) == 0)
+	{
+		r = read(fd, line + len, sizeof(line) - 1 - len);
+		if(r <= 0)
+		{
+			break;
+		}
+		
+		len += r;
+		line[len] = '\0';
+		
+		/* Run each complete line */
+		while(!ferror(reply) && (e = strchr(line, '\n')) != NULL)
+		{
+			*e = '\0';
+			if(e > line && e[-1] == '\r') e[-1] = '\0';
+			
+			s->fn(s->arg, line, reply);
+			fflush(reply);
+			
+			len -= e + 1 - line;
+			memmove(line, e + 1, len + 1);
+		}
+		
+		if(len == sizeof(line) - 1)
+		{
+			fprintf(reply, "ERROR Line too long\n");
+			break;
+		}
+	}
+	
+	fclose(reply);
+}
+
+static void *_control_thread(void *arg)
+{
+	struct control_t *s = arg;
+	int fd;
+	
+	while(_wait(s, s->fd) == 0)
+	{
+		fd = accept(s->fd, NULL, NULL);
+		if(fd < 0)
+		{
+			continue;
+		}
+		
+		_serve(s, fd);
+		close(fd);
+	}
+	
+	return(NULL);
+}
+
+int control_open(struct control_t *s, const char *path, int mode, control_fn_t fn, void *arg)
+{
+	struct sockaddr_un addr;
+	struct stat st;
+	mode_t mask;
+	int r;
+	
+	memset(s, 0, sizeof(struct control_t));
+	
+	if(strlen(path) >= sizeof(addr.sun_path))
+	{
+		fprintf(stderr, "Error: Control socket path '%s' is too long.\n", path);
+		return(-1);
+	}
+	
+	/* Replace a socket left behind by a previous run, but nothing else */
+	if(lstat(path, &st) == 0)
+	{
+		if(!S_ISSOCK(st.st_mode))
+		{
+			fprintf(stderr, "Error: Control socket path '%s' exists and is not a socket.\n", path);
+			return(-1);
+		}
+		
+		unlink(path);
+	}
+	
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+	
+	s->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if(s->fd < 0)
+	{
+		perror("socket");
+		return(-1);
+	}
+	
+	/* Anyone who can connect can change what's transmitted. The
+	 * socket is created accessible to the owner only, then opened
+	 * up to the requested mode before it starts listening */
+	mask = umask(0177);
+	r = bind(s->fd, (struct sockaddr *) &addr, sizeof(addr));
+	umask(mask);
+	
+	if(r != 0 ||
+	   chmod(path, mode) != 0 ||
+	   listen(s->fd, 4) != 0)
+	{
+		perror(path);
+		if(r == 0) unlink(path);
+		close(s->fd);
+		return(-1);
+	}
+	
+	s->path = strdup(path);
+	s->fn = fn;
+	s->arg = arg;
+	
+	if(pipe(s->pipe) != 0)
+	{
+		perror("pipe");
+		control_close(s);
+		return(-1);
+	}
+	
+	if(pthread_create(&s->thread, NULL, &_control_thread, s) != 0)
+	{
+		fprintf(stderr, "Error: Failed to start control thread.\n");
+		control_close(s);
+		return(-1);
+	}
+	
+	s->running = 1;
+	
+	return(0);
+}
+
+void control_close(struct control_t *s)
+{
+	if(s->running)
+	{
+		/* Wake the thread and wait for it to finish */
+		if(write(s->pipe[1], "", 1) != 1)
+		{
+			perror("write");
+		}
+		
+		pthread_join(s->thread, NULL);
+	}
+	
+	if(s->pipe[0] > 0)
+	{
+		close(s->pipe[0]);
+		close(s->pipe[1]);
+	}
+	
+	if(s->path)
+	{
+		close(s->fd);
+		unlink(s->path);
+		free(s->path);
+	}
+	
+	memset(s, 0, sizeof(struct control_t));
+}
+
+#else
+
+int control_open(struct control_t *s, const char *path, int mode, control_fn_t fn, void *arg)
+{
+	memset(s, 0, sizeof(struct control_t));
+	fprintf(stderr, "Error: The control socket is not supported on this platform.\n");
+	return(-1);
+}
+
+void control_close(struct control_t *s)
+{
+}
+
+#endif
+
@@ -0,0 +1,55 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+
+#ifndef _CONTROL_H
+#define _CONTROL_H
+
+#include <stdio.h>
+#include <pthread.h>
+
+/* Local control socket.
+ * 
+ * Listens on a UNIX domain socket and reads commands from clients one
+ * line at a time. Each line is passed to the callback along with a stream
+ * for the reply. Clients are served one at a time, on the control thread.
+ * The socket file is given the permissions in mode, such as 0600.
+*/
+
+typedef void (*control_fn_t)(void *arg, char *line, FILE *reply);
+
+struct control_t {
+	
+	int fd;
+	char *path;
+	
+	control_fn_t fn;
+	void *arg;
+	
+	/* Written to wake the thread when closing */
+	int pipe[2];
+	
+	pthread_t thread;
+	int running;
+	
+};
+
+extern int control_open(struct control_t *s, const char *path, int mode, control_fn_t fn, void *arg);
+extern void control_close(struct control_t *s);
+
+#endif
+
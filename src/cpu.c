@@ -0,0 +1,69 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdatomic.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <unistd.h>
+#endif
+#include "cpu.h"
+
+int cpu_features(void)
+{
+	static atomic_int features = -1;
+	int f;
+	
+	/* Any thread may be the first to ask */
+	f = atomic_load_explicit(&features, memory_order_relaxed);
+	if(f >= 0)
+	{
+		return(f);
+	}
+	
+	f = 0;
+	
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("sse2")) f |= CPU_SSE2;
+	if(__builtin_cpu_supports("sse4.1")) f |= CPU_SSE41;
+	if(__builtin_cpu_supports("avx2")) f |= CPU_AVX2;
+#elif defined(__ARM_NEON)
+	f |= CPU_NEON;
+#endif
+	
+	atomic_store_explicit(&features, f, memory_order_relaxed);
+	
+	return(f);
+}
+
+int cpu_count(void)
+{
+	/* Number of processors online, or 1 if unknown */
+#ifdef _WIN32
+	SYSTEM_INFO si;
+	
+	GetSystemInfo(&si);
+	
+	return(si.dwNumberOfProcessors > 0 ? si.dwNumberOfProcessors : 1);
+#else
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	
+	return(n > 0 ? n : 1);
+#endif
+}
+
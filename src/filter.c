@@ -17,13 +17,23 @@
 
 /* Taps for 40-15000Hz low pass filter at 32kHz with no, 50us and 75us
  * pre-emphasis. The phase response of these filters is not a good match for
- * a real FM pre-emphasis circuit, but audio quality seems unaffected */
+ * a real FM pre-emphasis circuit, but audio quality seems unaffected.
+ * Second-order section versions for the cheaper IIR filter follow */
 
 #include <stdint.h>
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
 #include "filter.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
 
 const double preemph_flat_taps[PREEMPH_TAPS] = {
 	 0.000000,-0.000793, 0.000318,-0.001297, 0.000756,-0.002084, 0.001341,
@@ -77,11 +87,294 @@ const double preemph_j17_taps[PREEMPH_TAPS] = {
 	-0.000175,-0.000119
 };
 
-int fir_int32_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps, int interpolation, int decimation, int delay)
+/* The same responses as second-order sections (b0 b1 b2 a1 a2) for the
+ * IIR pre-emphasis filter. The first stage is a first-order shelf with its
+ * corners moved to fit the analogue response at 32kHz, the second a 15kHz
+ * Butterworth low pass. Cheaper than the FIR, with a phase response
+ * closer to the real circuit, but without its 40Hz high pass */
+
+const double preemph_flat_sos[PREEMPH_IIR_STAGES * 5] = {
+	 1.000000000, 0.000000000, 0.000000000, 0.000000000, 0.000000000,
+	 0.870330779, 1.740661559, 0.870330779, 1.723776173, 0.757546944
+};
+
+const double preemph_50us_sos[PREEMPH_IIR_STAGES * 5] = {
+	 2.459043382,-1.258089031, 0.000000000, 0.200954351, 0.000000000,
+	 0.870330779, 1.740661559, 0.870330779, 1.723776173, 0.757546944
+};
+
+const double preemph_75us_sos[PREEMPH_IIR_STAGES * 5] = {
+	 3.371029426,-2.194477487, 0.000000000, 0.176551939, 0.000000000,
+	 0.870330779, 1.740661559, 0.870330779, 1.723776173, 0.757546944
+};
+
+const double preemph_j17_sos[PREEMPH_IIR_STAGES * 5] = {
+	 2.123691842,-1.932410892, 0.000000000,-0.437408973, 0.000000000,
+	 0.870330779, 1.740661559, 0.870330779, 1.723776173, 0.757546944
+};
+
+/* FIR multiply-accumulate kernels. Products are summed at 64-bits, so
+ * every version gives the same result regardless of the order. The taps
+ * are Q15 but can exceed 16 bits (the 75us centre tap is over 3.5), so
+ * the SIMD versions multiply full 32-bit values */
+
+static int64_t _dot(const int32_t *win, const int32_t *taps, int n)
+{
+	int64_t a = 0;
+	
+	while(n--)
+	{
+		a += (int64_t) *(win++) * (int64_t) *(taps++);
+	}
+	
+	return(a);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static int64_t _dot_avx2(const int32_t *win, const int32_t *taps, int n)
+{
+	__m256i a, b, acc;
+	__m128i h;
+	
+	acc = _mm256_setzero_si256();
+	
+	for(; n >= 8; n -= 8, win += 8, taps += 8)
+	{
+		a = _mm256_loadu_si256((const __m256i *) win);
+		b = _mm256_loadu_si256((const __m256i *) taps);
+		
+		/* Even lanes, then the odd lanes shifted down */
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(a, b));
+		acc = _mm256_add_epi64(acc, _mm256_mul_epi32(_mm256_srli_epi64(a, 32), _mm256_srli_epi64(b, 32)));
+	}
+	
+	h = _mm_add_epi64(_mm256_castsi256_si128(acc), _mm256_extracti128_si256(acc, 1));
+	h = _mm_add_epi64(h, _mm_unpackhi_epi64(h, h));
+	
+	return(_mm_cvtsi128_si64(h) + _dot(win, taps, n));
+}
+
+__attribute__((target("sse4.1")))
+static int64_t _dot_sse41(const int32_t *win, const int32_t *taps, int n)
+{
+	__m128i a, b, acc;
+	
+	acc = _mm_setzero_si128();
+	
+	for(; n >= 4; n -= 4, win += 4, taps += 4)
+	{
+		a = _mm_loadu_si128((const __m128i *) win);
+		b = _mm_loadu_si128((const __m128i *) taps);
+		
+		acc = _mm_add_epi64(acc, _mm_mul_epi32(a, b));
+		acc = _mm_add_epi64(acc, _mm_mul_epi32(_mm_srli_epi64(a, 32), _mm_srli_epi64(b, 32)));
+	}
+	
+	acc = _mm_add_epi64(acc, _mm_unpackhi_epi64(acc, acc));
+	
+	return(_mm_cvtsi128_si64(acc) + _dot(win, taps, n));
+}
+
+#endif
+
+#ifdef __ARM_NEON
+
+static int64_t _dot_neon(const int32_t *win, const int32_t *taps, int n)
+{
+	int32x4_t a, b;
+	int64x2_t acc;
+	
+	acc = vdupq_n_s64(0);
+	
+	for(; n >= 4; n -= 4, win += 4, taps += 4)
+	{
+		a = vld1q_s32(win);
+		b = vld1q_s32(taps);
+		
+		acc = vmlal_s32(acc, vget_low_s32(a), vget_low_s32(b));
+		acc = vmlal_s32(acc, vget_high_s32(a), vget_high_s32(b));
+	}
+	
+	return(vgetq_lane_s64(acc, 0) + vgetq_lane_s64(acc, 1) + _dot(win, taps, n));
+}
+
+#endif
+
+/* Dual kernels, running two sets of taps over the same window in one
+ * pass and adding the results to r[0] and r[1]. Each window sample is
+ * loaded once for both products */
+
+static void _dot2(const int32_t *win, const int32_t *ataps, const int32_t *btaps, int n, int64_t *r)
+{
+	int64_t a = 0, b = 0;
+	
+	while(n--)
+	{
+		a += (int64_t) *win * (int64_t) *(ataps++);
+		b += (int64_t) *win * (int64_t) *(btaps++);
+		win++;
+	}
+	
+	r[0] += a;
+	r[1] += b;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static void _dot2_avx2(const int32_t *win, const int32_t *ataps, const int32_t *btaps, int n, int64_t *r)
+{
+	__m256i w, wo, a, b, acca, accb;
+	__m128i h;
+	
+	acca = _mm256_setzero_si256();
+	accb = _mm256_setzero_si256();
+	
+	for(; n >= 8; n -= 8, win += 8, ataps += 8, btaps += 8)
+	{
+		w = _mm256_loadu_si256((const __m256i *) win);
+		wo = _mm256_srli_epi64(w, 32);
+		a = _mm256_loadu_si256((const __m256i *) ataps);
+		b = _mm256_loadu_si256((const __m256i *) btaps);
+		
+		acca = _mm256_add_epi64(acca, _mm256_mul_epi32(w, a));
+		acca = _mm256_add_epi64(acca, _mm256_mul_epi32(wo, _mm256_srli_epi64(a, 32)));
+		accb = _mm256_add_epi64(accb, _mm256_mul_epi32(w, b));
+		accb = _mm256_add_epi64(accb, _mm256_mul_epi32(wo, _mm256_srli_epi64(b, 32)));
+	}
+	
+	h = _mm_add_epi64(_mm256_castsi256_si128(acca), _mm256_extracti128_si256(acca, 1));
+	r[0] += _mm_cvtsi128_si64(_mm_add_epi64(h, _mm_unpackhi_epi64(h, h)));
+	
+	h = _mm_add_epi64(_mm256_castsi256_si128(accb), _mm256_extracti128_si256(accb, 1));
+	r[1] += _mm_cvtsi128_si64(_mm_add_epi64(h, _mm_unpackhi_epi64(h, h)));
+	
+	_dot2(win, ataps, btaps, n, r);
+}
+
+__attribute__((target("sse4.1")))
+static void _dot2_sse41(const int32_t *win, const int32_t *ataps, const int32_t *btaps, int n, int64_t *r)
+{
+	__m128i w, wo, a, b, acca, accb;
+	
+	acca = _mm_setzero_si128();
+	accb = _mm_setzero_si128();
+	
+	for(; n >= 4; n -= 4, win += 4, ataps += 4, btaps += 4)
+	{
+		w = _mm_loadu_si128((const __m128i *) win);
+		wo = _mm_srli_epi64(w, 32);
+		a = _mm_loadu_si128((const __m128i *) ataps);
+		b = _mm_loadu_si128((const __m128i *) btaps);
+		
+		acca = _mm_add_epi64(acca, _mm_mul_epi32(w, a));
+		acca = _mm_add_epi64(acca, _mm_mul_epi32(wo, _mm_srli_epi64(a, 32)));
+		accb = _mm_add_epi64(accb, _mm_mul_epi32(w, b));
+		accb = _mm_add_epi64(accb, _mm_mul_epi32(wo, _mm_srli_epi64(b, 32)));
+	}
+	
+	r[0] += _mm_cvtsi128_si64(_mm_add_epi64(acca, _mm_unpackhi_epi64(acca, acca)));
+	r[1] += _mm_cvtsi128_si64(_mm_add_epi64(accb, _mm_unpackhi_epi64(accb, accb)));
+	
+	_dot2(win, ataps, btaps, n, r);
+}
+
+#endif
+
+#ifdef __ARM_NEON
+
+static void _dot2_neon(const int32_t *win, const int32_t *ataps, const int32_t *btaps, int n, int64_t *r)
+{
+	int32x4_t w, a, b;
+	int64x2_t acca, accb;
+	
+	acca = vdupq_n_s64(0);
+	accb = vdupq_n_s64(0);
+	
+	for(; n >= 4; n -= 4, win += 4, ataps += 4, btaps += 4)
+	{
+		w = vld1q_s32(win);
+		a = vld1q_s32(ataps);
+		b = vld1q_s32(btaps);
+		
+		acca = vmlal_s32(acca, vget_low_s32(w), vget_low_s32(a));
+		acca = vmlal_s32(acca, vget_high_s32(w), vget_high_s32(a));
+		accb = vmlal_s32(accb, vget_low_s32(w), vget_low_s32(b));
+		accb = vmlal_s32(accb, vget_high_s32(w), vget_high_s32(b));
+	}
+	
+	r[0] += vgetq_lane_s64(acca, 0) + vgetq_lane_s64(acca, 1);
+	r[1] += vgetq_lane_s64(accb, 0) + vgetq_lane_s64(accb, 1);
+	
+	_dot2(win, ataps, btaps, n, r);
+}
+
+#endif
+
+void fir_low_pass(double *taps, unsigned int ntaps, double sample_rate, double cutoff, double gain)
+{
+	double x, fc;
+	int i;
+	
+	/* Hamming windowed sinc. For an interpolator the gain
+	 * should be the interpolation factor */
+	fc = 2.0 * cutoff / sample_rate;
+	
+	for(i = 0; i < ntaps; i++)
+	{
+		x = M_PI * fc * (i - (ntaps - 1) / 2.0);
+		
+		taps[i] = fc * gain * (x != 0 ? sin(x) / x : 1.0);
+		taps[i] *= 0.54 - 0.46 * cos(2.0 * M_PI * i / (ntaps - 1));
+	}
+}
+
+static void _fir_int32_kernels(struct fir_int32_t *s)
+{
+	s->dot = _dot;
+	s->dot2 = _dot2;
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		s->dot = _dot_avx2;
+		s->dot2 = _dot2_avx2;
+	}
+	else if(cpu_features() & CPU_SSE41)
+	{
+		s->dot = _dot_sse41;
+		s->dot2 = _dot2_sse41;
+	}
+#elif defined(__ARM_NEON)
+	s->dot = _dot_neon;
+	s->dot2 = _dot2_neon;
+#endif
+}
+
+static void _fir_int32_taps(struct fir_int32_t *s, int32_t *dst, const double *taps, unsigned int ntaps)
 {
 	int i, j;
 	
-	s->type = 1;
+	/* Split the taps into one set per phase, each reversed to run
+	 * over the window oldest sample first. Padding taps are zero */
+	memset(dst, 0, s->ntaps * sizeof(int32_t));
+	
+	j = s->ntaps - s->ataps;
+	for(i = ntaps - 1; i >= 0; i--)
+	{
+		dst[j] = lround(taps[i] * 32767.0);
+		j -= s->ataps;
+		if(j < 0) j += s->ntaps + 1;
+	}
+}
+
+static int _fir_int32_alloc(struct fir_int32_t *s, int type, unsigned int ntaps, int interpolation, int decimation, int delay)
+{
+	memset(s, 0, sizeof(struct fir_int32_t));
+	
+	s->type = type;
+	_fir_int32_kernels(s);
 	
 	s->interpolation = interpolation;
 	s->decimation = decimation;
@@ -91,54 +384,129 @@ int fir_int32_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps
 	s->ataps = s->ntaps / interpolation;
 	
 	s->itaps = malloc(s->ntaps * sizeof(int32_t));
-	s->qtaps = NULL;
-	
-	j = s->ntaps - s->ataps;
-	for(i = ntaps - 1; i >= 0; i--)
+	if(type == FIR_INT32_COMPLEX)
 	{
-		s->itaps[j] = lround(taps[i] * 32767.0);
-		j -= s->ataps;
-		if(j < 0) j += s->ntaps + 1;
+		s->qtaps = malloc(s->ntaps * sizeof(int32_t));
 	}
 	
+	/* The window is a round buffer with the first ataps samples
+	 * repeated after it, so every phase reads contiguous samples */
 	s->lwin = s->ataps + delay;
 	s->win = calloc(s->ataps * 2 + delay, sizeof(int32_t));
+	if(type != FIR_INT32_REAL)
+	{
+		s->qwin = calloc(s->ataps * 2 + delay, sizeof(int32_t));
+	}
+	
+	if(!s->itaps || !s->win ||
+	   (type == FIR_INT32_COMPLEX && !s->qtaps) ||
+	   (type != FIR_INT32_REAL && !s->qwin))
+	{
+		fir_int32_free(s);
+		return(-1);
+	}
+	
 	s->owin = 0;
 	s->d = 0;
 	
 	return(0);
 }
 
+int fir_int32_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps, int interpolation, int decimation, int delay)
+{
+	if(_fir_int32_alloc(s, FIR_INT32_REAL, ntaps, interpolation, decimation, delay) != 0)
+	{
+		return(-1);
+	}
+	
+	_fir_int32_taps(s, s->itaps, taps, ntaps);
+	
+	return(0);
+}
+
+int fir_int32_complex_init(struct fir_int32_t *s, const double *itaps, const double *qtaps, unsigned int ntaps, int interpolation, int decimation, int delay)
+{
+	if(_fir_int32_alloc(s, FIR_INT32_COMPLEX, ntaps, interpolation, decimation, delay) != 0)
+	{
+		return(-1);
+	}
+	
+	_fir_int32_taps(s, s->itaps, itaps, ntaps);
+	_fir_int32_taps(s, s->qtaps, qtaps, ntaps);
+	
+	return(0);
+}
+
+int fir_int32_scomplex_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps, int interpolation, int decimation, int delay)
+{
+	if(_fir_int32_alloc(s, FIR_INT32_SCOMPLEX, ntaps, interpolation, decimation, delay) != 0)
+	{
+		return(-1);
+	}
+	
+	_fir_int32_taps(s, s->itaps, taps, ntaps);
+	
+	return(0);
+}
+
+static inline int32_t _fir_int32_clip(int64_t a)
+{
+	a >>= 15;
+	return(a < INT32_MIN ? INT32_MIN : (a > INT32_MAX ? INT32_MAX : a));
+}
+
+static inline void _fir_int32_push(struct fir_int32_t *s, int32_t *win, int32_t v)
+{
+	/* Append the next input sample to the round buffer */
+	win[s->owin] = v;
+	if(s->owin < s->ataps) win[s->owin + s->lwin] = v;
+}
+
 size_t fir_int32_process(struct fir_int32_t *s, int32_t *out, const int32_t *in, size_t samples)
 {
-	int64_t a;
-	int x, y;
-	const int32_t *win, *taps;
+	int64_t r[2], q[2];
+	int x;
+	const int32_t *win, *qwin, *itaps, *qtaps;
 	
 	if(s->type == 0) return(0);
-	//else if(s->type == 2) return(fir_int32_complex_process(s, out, in, samples));
-	//else if(s->type == 3) return(fir_int32_scomplex_process(s, out, in, samples));
 	
 	for(x = 0; samples; samples--)
 	{
-		/* Append the next input sample to the round buffer */
-		s->win[s->owin] = *in;
-		if(s->owin < s->ataps) s->win[s->owin + s->lwin] = *in;
+		_fir_int32_push(s, s->win, in[0]);
+		if(s->type != FIR_INT32_REAL) _fir_int32_push(s, s->qwin, in[1]);
 		if(++s->owin == s->lwin) s->owin = 0;
 		
 		for(; s->d < s->interpolation; s->d += s->decimation)
 		{
 			win = &s->win[s->owin];
-			taps = &s->itaps[s->d * s->ataps];
+			itaps = &s->itaps[s->d * s->ataps];
 			
 			/* Calculate the next output sample */
-			for(a = y = 0; y < s->ataps; y++)
+			if(s->type == FIR_INT32_REAL)
 			{
-				a += (int64_t) *(win++) * (int64_t) *(taps++);
+				out[0] = _fir_int32_clip(s->dot(win, itaps, s->ataps));
+			}
+			else if(s->type == FIR_INT32_SCOMPLEX)
+			{
+				qwin = &s->qwin[s->owin];
+				out[0] = _fir_int32_clip(s->dot(win, itaps, s->ataps));
+				out[1] = _fir_int32_clip(s->dot(qwin, itaps, s->ataps));
+			}
+			else
+			{
+				/* (wi + jwq)(ti + jtq), each window against
+				 * both sets of taps in one pass */
+				qwin = &s->qwin[s->owin];
+				qtaps = &s->qtaps[s->d * s->ataps];
+				
+				r[0] = r[1] = q[0] = q[1] = 0;
+				s->dot2(win, itaps, qtaps, s->ataps, r);
+				s->dot2(qwin, itaps, qtaps, s->ataps, q);
+				
+				out[0] = _fir_int32_clip(r[0] - q[1]);
+				out[1] = _fir_int32_clip(q[0] + r[1]);
 			}
 			
-			a >>= 15;
-			*out = a < INT32_MIN ? INT32_MIN : (a > INT32_MAX ? INT32_MAX : a);
 			out += 2;
 			x++;
 		}
@@ -153,21 +521,208 @@ size_t fir_int32_process(struct fir_int32_t *s, int32_t *out, const int32_t *in,
 void fir_int32_free(struct fir_int32_t *s)
 {
 	free(s->win);
+	free(s->qwin);
 	free(s->itaps);
 	free(s->qtaps);
 	memset(s, 0, sizeof(struct fir_int32_t));
 }
 
+void iir_int32_free(struct iir_int32_t *s)
+{
+	free(s->coeffs);
+	free(s->state);
+	memset(s, 0, sizeof(struct iir_int32_t));
+}
+
+int iir_int32_init(struct iir_int32_t *s, const double *sos, int stages)
+{
+	int i;
+	
+	memset(s, 0, sizeof(struct iir_int32_t));
+	
+	s->coeffs = malloc(sizeof(int32_t) * stages * 5);
+	s->state = calloc(sizeof(int32_t), stages * 4);
+	if(!s->coeffs || !s->state)
+	{
+		iir_int32_free(s);
+		return(-1);
+	}
+	
+	/* Coefficients are Q28, enough headroom for a shelf gain of 8 */
+	for(i = 0; i < stages * 5; i++)
+	{
+		s->coeffs[i] = lround(sos[i] * (1 << 28));
+	}
+	
+	s->stages = stages;
+	
+	return(0);
+}
+
+void iir_int32_process(struct iir_int32_t *s, int32_t *data, int samples)
+{
+	const int32_t *c;
+	int32_t x1, x2, y1, y2;
+	int64_t a;
+	int i, j;
+	
+	/* Values between stages carry 8 extra bits of fraction to keep
+	 * rounding noise well below the input */
+	for(i = 0; i < samples; i++)
+	{
+		data[i] *= 256;
+	}
+	
+	/* Run each stage over the whole block in turn, in place. The
+	 * state is kept in locals as data may alias it */
+	for(j = 0; j < s->stages; j++)
+	{
+		c = &s->coeffs[j * 5];
+		x1 = s->state[j * 4 + 0];
+		x2 = s->state[j * 4 + 1];
+		y1 = s->state[j * 4 + 2];
+		y2 = s->state[j * 4 + 3];
+		
+		for(i = 0; i < samples; i++)
+		{
+			/* Only the last term depends on the previous output */
+			a  = (int64_t) c[0] * data[i] + (1 << 27);
+			a += (int64_t) c[1] * x1;
+			a += (int64_t) c[2] * x2;
+			a -= (int64_t) c[4] * y2;
+			a -= (int64_t) c[3] * y1;
+			a >>= 28;
+			
+			x2 = x1;
+			x1 = data[i];
+			y2 = y1;
+			y1 = a;
+			
+			/* The stages are stable so the feedback can't run away,
+			 * clamping only the output keeps it off the critical path */
+			data[i] = a < INT32_MIN / 256 ? INT32_MIN / 256 : (a > INT32_MAX / 256 ? INT32_MAX / 256 : a);
+		}
+		
+		s->state[j * 4 + 0] = x1;
+		s->state[j * 4 + 1] = x2;
+		s->state[j * 4 + 2] = y1;
+		s->state[j * 4 + 3] = y2;
+	}
+	
+	for(i = 0; i < samples; i++)
+	{
+		data[i] = (data[i] + 128) >> 8;
+	}
+}
+
+static int _fir_int32_history(const struct fir_int32_t *s)
+{
+	/* Samples needed ahead of a block by a 1:1 filter */
+	return(s->type && s->ataps > 0 ? s->ataps - 1 : 0);
+}
+
+static void _fir_int32_block(struct fir_int32_t *s, int32_t *out, const int32_t *win, int samples)
+{
+	int64_t a;
+	int x;
+	
+	/* Filter a block of contiguous samples with a 1:1 filter. The
+	 * window holds the history followed by the block, so each output
+	 * is a single multiply-accumulate over contiguous samples */
+	if(s->type == 0)
+	{
+		memcpy(out, win, sizeof(int32_t) * samples);
+		return;
+	}
+	
+	for(x = 0; x < samples; x++)
+	{
+		a = s->dot(win + x, s->itaps, s->ataps) >> 15;
+		out[x] = a < INT32_MIN ? INT32_MIN : (a > INT32_MAX ? INT32_MAX : a);
+	}
+}
+
+static void _fir_int32_dual_block(struct limiter_t *s, int32_t *vout, int32_t *fout, const int32_t *win, int samples)
+{
+	int64_t r[2];
+	int x;
+	
+	/* Run both input filters over the same window in one pass */
+	for(x = 0; x < samples; x++)
+	{
+		r[0] = r[1] = 0;
+		s->vfir.dot2(win + x, s->vfir.itaps, s->ffir.itaps, s->vfir.ataps, r);
+		
+		r[0] >>= 15;
+		r[1] >>= 15;
+		vout[x] = r[0] < INT32_MIN ? INT32_MIN : (r[0] > INT32_MAX ? INT32_MAX : r[0]);
+		fout[x] = r[1] < INT32_MIN ? INT32_MIN : (r[1] > INT32_MAX ? INT32_MAX : r[1]);
+	}
+}
+
 void limiter_free(struct limiter_t *s)
 {
 	fir_int32_free(&s->vfir);
 	fir_int32_free(&s->ffir);
-	free(s->shape);
-	free(s->att);
+	iir_int32_free(&s->viir);
+	iir_int32_free(&s->fiir);
+	free(s->qval);
+	free(s->qpos);
+	free(s->avg[0].v);
+	free(s->avg[1].v);
+	free(s->vwin);
+	free(s->fwin);
 	free(s->fix);
 	free(s->var);
 }
 
+static int _limiter_alloc(struct limiter_t *s, int16_t level, int width)
+{
+	int i;
+	
+	/* The envelope reaches a peak's attenuation, and starts to rise
+	 * towards it, half the width before the peak. Holding it for
+	 * at least as long as the two averages span keeps it there */
+	s->width = width | 1;
+	s->hold = (s->width / 2 + 1) / 2;
+	s->avg[0].len = (s->width / 2 - s->hold + 1) / 2;
+	s->avg[1].len = s->width / 2 - s->hold - s->avg[0].len;
+	
+	s->qsize = s->hold * 2 + 2;
+	s->qval = malloc(sizeof(int16_t) * s->qsize);
+	s->qpos = malloc(sizeof(unsigned int) * s->qsize);
+	if(!s->qval || !s->qpos)
+	{
+		limiter_free(s);
+		return(-1);
+	}
+	
+	for(i = 0; i < 2; i++)
+	{
+		s->avg[i].len = s->avg[i].len * 2 + 1;
+		s->avg[i].v = calloc(sizeof(int16_t), s->avg[i].len);
+		if(!s->avg[i].v)
+		{
+			limiter_free(s);
+			return(-1);
+		}
+	}
+	
+	/* Initial state */
+	s->level = level;
+	s->vwin = calloc(sizeof(int32_t), _fir_int32_history(&s->vfir) + LIMITER_BLOCK);
+	s->fwin = calloc(sizeof(int32_t), _fir_int32_history(&s->ffir) + LIMITER_BLOCK);
+	s->fix = calloc(sizeof(int32_t), s->width - 1 + LIMITER_BLOCK);
+	s->var = calloc(sizeof(int32_t), s->width - 1 + LIMITER_BLOCK);
+	if(!s->vwin || !s->fwin || !s->fix || !s->var)
+	{
+		limiter_free(s);
+		return(-1);
+	}
+	
+	return(0);
+}
+
 int limiter_init(struct limiter_t *s, int16_t level, int width, const double *vtaps, const double *ftaps, int ntaps)
 {
 	int i;
@@ -197,88 +752,195 @@ int limiter_init(struct limiter_t *s, int16_t level, int width, const double *vt
 		}
 	}
 	
-	/* Generate the limiter response shape */
-	s->width = width | 1;
-	s->shape = malloc(sizeof(int16_t) * s->width);
-	if(!s->shape)
+	return(_limiter_alloc(s, level, width));
+}
+
+int limiter_init_iir(struct limiter_t *s, int16_t level, int width, const double *vsos, const double *fsos, int stages)
+{
+	int i;
+	
+	memset(s, 0, sizeof(struct limiter_t));
+	
+	if(vsos)
 	{
-		limiter_free(s);
-		return(-1);
+		i = iir_int32_init(&s->viir, vsos, stages);
+		if(i != 0)
+		{
+			limiter_free(s);
+			return(-1);
+		}
+	}
+	
+	if(fsos)
+	{
+		i = iir_int32_init(&s->fiir, fsos, stages);
+		if(i != 0)
+		{
+			limiter_free(s);
+			return(-1);
+		}
 	}
 	
-	for(i = 0; i < s->width; i++)
+	return(_limiter_alloc(s, level, width));
+}
+
+static int32_t _limiter_envelope(struct limiter_t *s, int32_t a)
+{
+	struct _limiter_avg_t *avg;
+	int k;
+	
+	/* Nothing to do while the envelope is all zeros */
+	if(a == 0 && s->avg[0].sum == 0 && s->avg[1].sum == 0 && (s->qlen == 0 || s->qval[s->qhead] == 0))
 	{
-		s->shape[i] = lround((1.0 - cos(2.0 * M_PI / (s->width + 1) * (i + 1))) * 0.5 * INT16_MAX);
+		return(0);
 	}
 	
-	/* Initial state */
-	s->level = level;
-	s->att = calloc(sizeof(int16_t), s->width);
-	s->fix = calloc(sizeof(int32_t), s->width);
-	s->var = calloc(sizeof(int32_t), s->width);
-	if(!s->att || !s->fix || !s->var)
+	/* Add the attenuation needed at the newest sample to the queue,
+	 * dropping any smaller values it replaces, and drop the oldest
+	 * value once it leaves the window. Each value enters and leaves
+	 * the queue once, whatever the width */
+	while(s->qlen > 0)
 	{
-		limiter_free(s);
-		return(-1);
+		k = s->qhead + s->qlen - 1;
+		if(k >= s->qsize) k -= s->qsize;
+		if(s->qval[k] > a) break;
+		s->qlen--;
 	}
 	
-	s->p = 0;
-	s->h = s->width / 2;
+	k = s->qhead + s->qlen++;
+	if(k >= s->qsize) k -= s->qsize;
+	s->qval[k] = a;
+	s->qpos[k] = s->pos;
 	
-	return(0);
+	if(s->pos - s->qpos[s->qhead] > (unsigned int) s->hold * 2)
+	{
+		if(++s->qhead == s->qsize) s->qhead = 0;
+		s->qlen--;
+	}
+	
+	s->pos++;
+	a = s->qval[s->qhead];
+	
+	/* Smooth the held value */
+	for(k = 0; k < 2; k++)
+	{
+		avg = &s->avg[k];
+		
+		avg->sum += a - avg->v[avg->p];
+		avg->v[avg->p] = a;
+		if(++avg->p == avg->len) avg->p = 0;
+		
+		a = avg->sum / avg->len;
+	}
+	
+	return(a);
 }
 
-void limiter_process(struct limiter_t *s, int16_t *out, const int16_t *vin, const int16_t *fin, int samples, int step)
+static void _limiter_block(struct limiter_t *s, int16_t *out, const int16_t *vin, const int16_t *fin, int samples, int step)
 {
-	int i, j;
+	const int w = s->width - 1;
+	int32_t *vwin = s->vwin + _fir_int32_history(&s->vfir);
+	int32_t *fwin = s->fwin + _fir_int32_history(&s->ffir);
+	int i, h, shared;
 	int32_t a, b;
 	
+	/* When vin and fin are the same signal both filters can share
+	 * one window, if they are the same length and their histories
+	 * match (they won't if the last block had a different fin) */
+	shared = (vin == fin && s->vfir.type && s->ffir.type && s->vfir.ataps == s->ffir.ataps);
+	shared = (shared && memcmp(s->vwin, s->fwin, sizeof(int32_t) * _fir_int32_history(&s->vfir)) == 0);
+	
+	/* The whole input is read before any output is written,
+	 * as out may be the same buffer as vin or fin */
 	for(i = 0; i < samples; i++)
 	{
-		s->var[s->p] = *vin;
-		s->fix[s->p] = (fin ? *fin : 0);
-		s->att[s->p] = 0;
-		
-		/* Apply input filters */
-		if(s->vfir.type) fir_int32_process(&s->vfir, &s->var[s->p], &s->var[s->p], 1);
-		if(s->ffir.type) fir_int32_process(&s->ffir, &s->fix[s->p], &s->fix[s->p], 1);
-		
+		vwin[i] = vin[i * step];
+		if(!shared) fwin[i] = (fin ? fin[i * step] : 0);
+	}
+	
+	/* Apply input filters */
+	if(shared)
+	{
+		_fir_int32_dual_block(s, s->var + w, s->fix + w, s->vwin, samples);
+	}
+	else
+	{
+		_fir_int32_block(&s->vfir, s->var + w, s->vwin, samples);
+		_fir_int32_block(&s->ffir, s->fix + w, s->fwin, samples);
+	}
+	
+	if(s->viir.stages) iir_int32_process(&s->viir, s->var + w, samples);
+	if(s->fiir.stages) iir_int32_process(&s->fiir, s->fix + w, samples);
+	
+	for(i = w; i < w + samples; i++)
+	{
 		/* Hard limit the fixed input */
-		if(s->fix[s->p] < -s->level) s->fix[s->p] = -s->level;
-		else if(s->fix[s->p] > s->level) s->fix[s->p] = s->level;
+		if(s->fix[i] < -s->level) s->fix[i] = -s->level;
+		else if(s->fix[i] > s->level) s->fix[i] = s->level;
 		
 		/* The variable signal is the difference between vin and fin */
-		s->var[s->p] -= s->fix[s->p];
-		
-		if(++s->p == s->width) s->p = 0;
-		if(++s->h == s->width) s->h = 0;
+		s->var[i] -= s->fix[i];
+	}
+	
+	/* Soft limit the variable input. The attenuation needed at each
+	 * sample is found half the width ahead of the output, which runs
+	 * w behind the input */
+	for(i = 0; i < samples; i++)
+	{
+		h = i + s->width / 2;
 		
-		/* Soft limit the variable input */
-		a = abs(s->var[s->h] + s->fix[s->h]);
+		a = abs(s->var[h] + s->fix[h]);
 		if(a > s->level)
 		{
-			a = INT16_MAX - (s->level + abs(s->var[s->h]) - a) * INT16_MAX / abs(s->var[s->h]);
-			
-			for(j = 0; j < s->width; j++)
-			{
-				b = (a * s->shape[j]) >> 15;
-				if(b > s->att[s->p]) s->att[s->p] = b;
-				if(++s->p == s->width) s->p = 0;
-			}
+			a = INT16_MAX - (s->level + abs(s->var[h]) - a) * INT16_MAX / abs(s->var[h]);
 		}
+		else
+		{
+			a = 0;
+		}
+		
+		b = _limiter_envelope(s, a);
 		
-		a  = s->fix[s->p];
-		a += ((int64_t) s->var[s->p] * (INT16_MAX - s->att[s->p])) >> 15;
+		a  = s->fix[i];
+		a += ((int64_t) s->var[i] * (INT16_MAX - b)) >> 15;
 		
 		/* Hard limit to catch rounding errors */
 		if(a < -s->level) a = -s->level;
 		else if(a > s->level) a = s->level;
 		
-		*out = a;
+		out[i * step] = a;
+	}
+	
+	/* Keep the history for the next block */
+	memmove(s->vwin, s->vwin + samples, sizeof(int32_t) * _fir_int32_history(&s->vfir));
+	
+	if(shared)
+	{
+		memcpy(s->fwin, s->vwin, sizeof(int32_t) * _fir_int32_history(&s->ffir));
+	}
+	else
+	{
+		memmove(s->fwin, s->fwin + samples, sizeof(int32_t) * _fir_int32_history(&s->ffir));
+	}
+	
+	memmove(s->var, s->var + samples, sizeof(int32_t) * w);
+	memmove(s->fix, s->fix + samples, sizeof(int32_t) * w);
+}
+
+void limiter_process(struct limiter_t *s, int16_t *out, const int16_t *vin, const int16_t *fin, int samples, int step)
+{
+	int l;
+	
+	/* Filter and limit the input a block at a time */
+	for(; samples > 0; samples -= l)
+	{
+		l = (samples < LIMITER_BLOCK ? samples : LIMITER_BLOCK);
+		
+		_limiter_block(s, out, vin, fin, l, step);
 		
-		vin += step;
-		out += step;
-		if(fin) fin += step;
+		vin += l * step;
+		out += l * step;
+		if(fin) fin += l * step;
 	}
 }
 
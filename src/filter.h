@@ -19,6 +19,7 @@
 #define _FILTER_H
 
 #include <stdint.h>
+#include <stddef.h>
 
 /* Pre-defined audio filter taps */
 
@@ -29,7 +30,24 @@ extern const double preemph_50us_taps[PREEMPH_TAPS];
 extern const double preemph_75us_taps[PREEMPH_TAPS];
 extern const double preemph_j17_taps[PREEMPH_TAPS];
 
-/* FIR filters (int32) */
+#define PREEMPH_IIR_STAGES 2
+
+extern const double preemph_flat_sos[PREEMPH_IIR_STAGES * 5];
+extern const double preemph_50us_sos[PREEMPH_IIR_STAGES * 5];
+extern const double preemph_75us_sos[PREEMPH_IIR_STAGES * 5];
+extern const double preemph_j17_sos[PREEMPH_IIR_STAGES * 5];
+
+/* FIR filters (int32). Polyphase, interpolating by interpolation and then
+ * decimating by decimation. Samples are read and written in pairs:
+ *
+ * FIR_INT32_REAL     - Real taps, filters the first of each pair only
+ * FIR_INT32_COMPLEX  - Complex taps, complex I/Q input and output
+ * FIR_INT32_SCOMPLEX - Real taps, applied to both I and Q
+ */
+
+#define FIR_INT32_REAL     1
+#define FIR_INT32_COMPLEX  2
+#define FIR_INT32_SCOMPLEX 3
 
 struct fir_int32_t {
 	
@@ -43,37 +61,95 @@ struct fir_int32_t {
 	int32_t *itaps;
 	int32_t *qtaps;
 	
+	/* Multiply-accumulate kernels, chosen for the CPU. dot2 runs
+	 * two sets of taps over one window */
+	int64_t (*dot)(const int32_t *win, const int32_t *taps, int n);
+	void (*dot2)(const int32_t *win, const int32_t *ataps, const int32_t *btaps, int n, int64_t *r);
+	
 	unsigned int owin;
 	unsigned int lwin;
 	int32_t *win;
+	int32_t *qwin;
 	int d;
 	
 };
 
+extern void fir_low_pass(double *taps, unsigned int ntaps, double sample_rate, double cutoff, double gain);
+extern int fir_int32_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps, int interpolation, int decimation, int delay);
+extern int fir_int32_complex_init(struct fir_int32_t *s, const double *itaps, const double *qtaps, unsigned int ntaps, int interpolation, int decimation, int delay);
+extern int fir_int32_scomplex_init(struct fir_int32_t *s, const double *taps, unsigned int ntaps, int interpolation, int decimation, int delay);
+extern size_t fir_int32_process(struct fir_int32_t *s, int32_t *out, const int32_t *in, size_t samples);
+extern void fir_int32_free(struct fir_int32_t *s);
+
+/* IIR filters (int32), a cascade of second-order sections */
+
+struct iir_int32_t {
+	
+	int stages;
+	
+	/* b0 b1 b2 a1 a2 for each stage, Q28 */
+	int32_t *coeffs;
+	
+	/* x1 x2 y1 y2 for each stage */
+	int32_t *state;
+	
+};
+
+extern int iir_int32_init(struct iir_int32_t *s, const double *sos, int stages);
+extern void iir_int32_process(struct iir_int32_t *s, int32_t *data, int samples);
+extern void iir_int32_free(struct iir_int32_t *s);
+
 /* Audio filter and soft limiter */
 
+/* Samples filtered and limited at a time, one ADR frame */
+#define LIMITER_BLOCK 1152
+
+struct _limiter_avg_t {
+	int len;
+	int p;
+	int32_t sum;
+	int16_t *v;
+};
+
 struct limiter_t {
 	
 	/* Input fir filters */
 	struct fir_int32_t vfir;
 	struct fir_int32_t ffir;
 	
-	/* Limiter shape */
+	/* Or input iir filters */
+	struct iir_int32_t viir;
+	struct iir_int32_t fiir;
+	
+	/* Limiter width */
 	int width;
-	int16_t *shape;
 	
-	/* Limiter state */
+	/* Attenuation envelope. The attenuation needed by each peak is held
+	 * for hold samples either side by a sliding maximum, kept as a queue
+	 * of falling values, then smoothed by two running averages */
+	int hold;
+	unsigned int pos;
+	int qsize;
+	int qhead;
+	int qlen;
+	int16_t *qval;
+	unsigned int *qpos;
+	struct _limiter_avg_t avg[2];
+	
+	/* Filter inputs for a block, led by the filter history */
+	int32_t *vwin;
+	int32_t *fwin;
+	
+	/* Limiter state for a block, led by width - 1 samples of history */
 	int16_t level;
 	int32_t *fix;
 	int32_t *var;
-	int16_t *att;
-	int p;
-	int h;
 	
 };
 
 extern void limiter_free(struct limiter_t *s);
 extern int limiter_init(struct limiter_t *s, int16_t level, int width, const double *vtaps, const double *ftaps, int ntaps);
+extern int limiter_init_iir(struct limiter_t *s, int16_t level, int width, const double *vsos, const double *fsos, int stages);
 extern void limiter_process(struct limiter_t *s, int16_t *out, const int16_t *vin, const int16_t *fin, int samples, int step);
 
 #endif
@@ -0,0 +1,320 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include "pool.h"
+
+/* The pool and worker number of the current thread, if any */
+static _Thread_local struct pool_t *_pool = NULL;
+static _Thread_local int _worker = -1;
+
+static int _queue_push(struct _pool_queue_t *q, pool_fn_t fn, void *arg)
+{
+	struct pool_task_t *tasks;
+	int i;
+	
+	pthread_mutex_lock(&q->mutex);
+	
+	if(q->len == q->size)
+	{
+		/* The queue is full, double its size */
+		tasks = malloc(sizeof(struct pool_task_t) * q->size * 2);
+		if(!tasks)
+		{
+			pthread_mutex_unlock(&q->mutex);
+			return(-1);
+		}
+		
+		for(i = 0; i < q->len; i++)
+		{
+			tasks[i] = q->tasks[(q->head + i) % q->size];
+		}
+		
+		free(q->tasks);
+		q->tasks = tasks;
+		q->size *= 2;
+		q->head = 0;
+	}
+	
+	i = (q->head + q->len) % q->size;
+	q->tasks[i].fn = fn;
+	q->tasks[i].arg = arg;
+	q->len++;
+	
+	pthread_mutex_unlock(&q->mutex);
+	
+	return(0);
+}
+
+static int _queue_pop(struct _pool_queue_t *q, struct pool_task_t *t, int newest)
+{
+	pthread_mutex_lock(&q->mutex);
+	
+	if(q->len == 0)
+	{
+		pthread_mutex_unlock(&q->mutex);
+		return(-1);
+	}
+	
+	if(newest)
+	{
+		*t = q->tasks[(q->head + q->len - 1) % q->size];
+	}
+	else
+	{
+		*t = q->tasks[q->head];
+		q->head = (q->head + 1) % q->size;
+	}
+	
+	q->len--;
+	
+	pthread_mutex_unlock(&q->mutex);
+	
+	return(0);
+}
+
+static int _take(struct pool_t *p, int worker, struct pool_task_t *t)
+{
+	int i;
+	
+	/* Take the newest task from our own queue */
+	if(worker < p->workers &&
+	   _queue_pop(&p->queues[worker], t, 1) == 0)
+	{
+		return(0);
+	}
+	
+	/* Or steal the oldest from another */
+	for(i = 1; i <= p->workers; i++)
+	{
+		if(_queue_pop(&p->queues[(worker + i) % p->workers], t, 0) == 0)
+		{
+			return(0);
+		}
+	}
+	
+	return(-1);
+}
+
+static void _run(struct pool_t *p, struct pool_task_t *t, int worker)
+{
+	atomic_fetch_sub(&p->queued, 1);
+	
+	t->fn(t->arg, worker);
+	
+	if(atomic_fetch_sub(&p->pending, 1) == 1)
+	{
+		/* That was the last one, wake the waiting thread */
+		pthread_mutex_lock(&p->mutex);
+		pthread_cond_broadcast(&p->done);
+		pthread_mutex_unlock(&p->mutex);
+	}
+}
+
+static void *_worker_thread(void *arg)
+{
+	struct _pool_worker_t *w = arg;
+	struct pool_t *p = w->pool;
+	struct pool_task_t t;
+	
+	_pool = p;
+	_worker = w->index;
+	
+	for(;;)
+	{
+		if(_take(p, w->index, &t) == 0)
+		{
+			_run(p, &t, w->index);
+			continue;
+		}
+		
+		/* Nothing to do, sleep until more tasks are queued */
+		pthread_mutex_lock(&p->mutex);
+		
+		while(!p->stop && atomic_load(&p->queued) == 0)
+		{
+			pthread_cond_wait(&p->cond, &p->mutex);
+		}
+		
+		if(p->stop)
+		{
+			pthread_mutex_unlock(&p->mutex);
+			break;
+		}
+		
+		pthread_mutex_unlock(&p->mutex);
+	}
+	
+	return(NULL);
+}
+
+int pool_init(struct pool_t *p, int workers)
+{
+	int i;
+	
+	memset(p, 0, sizeof(struct pool_t));
+	
+	p->workers = workers;
+	atomic_init(&p->queued, 0);
+	atomic_init(&p->pending, 0);
+	atomic_init(&p->next, 0);
+	pthread_mutex_init(&p->mutex, NULL);
+	pthread_cond_init(&p->cond, NULL);
+	pthread_cond_init(&p->done, NULL);
+	
+	p->queues = calloc(workers, sizeof(struct _pool_queue_t));
+	p->threads = calloc(workers, sizeof(struct _pool_worker_t));
+	if(!p->queues || !p->threads)
+	{
+		pool_free(p);
+		return(-1);
+	}
+	
+	for(i = 0; i < workers; i++)
+	{
+		pthread_mutex_init(&p->queues[i].mutex, NULL);
+		p->queues[i].size = 64;
+		p->queues[i].tasks = malloc(sizeof(struct pool_task_t) * p->queues[i].size);
+		if(!p->queues[i].tasks)
+		{
+			pool_free(p);
+			return(-1);
+		}
+	}
+	
+	for(i = 0; i < workers; i++)
+	{
+		p->threads[i].pool = p;
+		p->threads[i].index = i;
+		
+		if(pthread_create(&p->threads[i].thread, NULL, _worker_thread, &p->threads[i]) != 0)
+		{
+			pool_free(p);
+			return(-1);
+		}
+		
+		p->threads[i].running = 1;
+	}
+	
+	return(0);
+}
+
+void pool_free(struct pool_t *p)
+{
+	int i;
+	
+	pthread_mutex_lock(&p->mutex);
+	p->stop = 1;
+	pthread_cond_broadcast(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	
+	if(p->threads)
+	{
+		for(i = 0; i < p->workers; i++)
+		{
+			if(p->threads[i].running)
+			{
+				pthread_join(p->threads[i].thread, NULL);
+			}
+		}
+		
+		free(p->threads);
+	}
+	
+	if(p->queues)
+	{
+		for(i = 0; i < p->workers; i++)
+		{
+			free(p->queues[i].tasks);
+			pthread_mutex_destroy(&p->queues[i].mutex);
+		}
+		
+		free(p->queues);
+	}
+	
+	pthread_cond_destroy(&p->done);
+	pthread_cond_destroy(&p->cond);
+	pthread_mutex_destroy(&p->mutex);
+	
+	memset(p, 0, sizeof(struct pool_t));
+}
+
+int pool_submit(struct pool_t *p, pool_fn_t fn, void *arg)
+{
+	int q;
+	
+	if(_pool == p && _worker < p->workers)
+	{
+		/* Submitted by a worker, push onto its own queue */
+		q = _worker;
+	}
+	else
+	{
+		q = atomic_fetch_add(&p->next, 1) % p->workers;
+	}
+	
+	atomic_fetch_add(&p->pending, 1);
+	atomic_fetch_add(&p->queued, 1);
+	
+	if(_queue_push(&p->queues[q], fn, arg) != 0)
+	{
+		atomic_fetch_sub(&p->queued, 1);
+		atomic_fetch_sub(&p->pending, 1);
+		return(-1);
+	}
+	
+	pthread_mutex_lock(&p->mutex);
+	pthread_cond_signal(&p->cond);
+	pthread_mutex_unlock(&p->mutex);
+	
+	return(0);
+}
+
+void pool_wait(struct pool_t *p)
+{
+	struct pool_task_t t;
+	struct pool_t *pool = _pool;
+	int worker = _worker;
+	
+	_pool = p;
+	_worker = p->workers;
+	
+	while(atomic_load(&p->pending) > 0)
+	{
+		/* Help out while there are tasks queued */
+		if(_take(p, p->workers, &t) == 0)
+		{
+			_run(p, &t, p->workers);
+			continue;
+		}
+		
+		pthread_mutex_lock(&p->mutex);
+		
+		while(atomic_load(&p->pending) > 0 && atomic_load(&p->queued) == 0)
+		{
+			pthread_cond_wait(&p->done, &p->mutex);
+		}
+		
+		pthread_mutex_unlock(&p->mutex);
+	}
+	
+	_pool = pool;
+	_worker = worker;
+}
+
@@ -0,0 +1,87 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _POOL_H
+#define _POOL_H
+
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Work-stealing thread pool.
+ *
+ * Each worker has its own task queue. Tasks submitted from a worker are
+ * pushed onto that worker's queue and run newest first, while idle
+ * workers steal the oldest tasks from the other queues. Tasks submitted
+ * from outside the pool are spread across the queues.
+ *
+ * pool_wait() returns once every submitted task has completed, including
+ * any tasks submitted by those tasks. The calling thread runs tasks
+ * while it waits, as worker number 'workers'.
+*/
+
+typedef void (*pool_fn_t)(void *arg, int worker);
+
+struct pool_task_t {
+	pool_fn_t fn;
+	void *arg;
+};
+
+struct _pool_queue_t {
+	
+	pthread_mutex_t mutex;
+	struct pool_task_t *tasks;
+	int size;
+	int head;
+	int len;
+	
+};
+
+struct _pool_worker_t {
+	struct pool_t *pool;
+	pthread_t thread;
+	int index;
+	int running;
+};
+
+struct pool_t {
+	
+	int workers;
+	struct _pool_queue_t *queues;
+	struct _pool_worker_t *threads;
+	atomic_int next;
+	
+	/* Tasks queued, and tasks submitted but not yet completed */
+	atomic_int queued;
+	atomic_int pending;
+	
+	/* Idle workers sleep here */
+	pthread_mutex_t mutex;
+	pthread_cond_t cond;
+	int stop;
+	
+	/* The waiting thread sleeps here */
+	pthread_cond_t done;
+	
+};
+
+extern int pool_init(struct pool_t *p, int workers);
+extern void pool_free(struct pool_t *p);
+extern int pool_submit(struct pool_t *p, pool_fn_t fn, void *arg);
+extern void pool_wait(struct pool_t *p);
+
+#endif
+
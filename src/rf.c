@@ -19,7 +19,13 @@
 #include <stdlib.h>
 #include <string.h>
 #include <math.h>
+#include <pthread.h>
 #include "rf.h"
+#include "cpu.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#endif
 
 #include <stdio.h>
 
@@ -39,11 +45,70 @@ extern int rf_live(struct rf_t *s)
 	return(s->live);
 }
 
-int rf_write(struct rf_t *s, int16_t *iq_data, int samples)
+size_t rf_sample_size(struct rf_t *s)
+{
+	if(s->convert && s->sample_size)
+	{
+		return(s->sample_size);
+	}
+	
+	return(sizeof(int16_t) * 2);
+}
+
+int rf_convert(struct rf_t *s, void *dst, const int16_t *iq_data, int samples)
+{
+	if(s->convert)
+	{
+		return(s->convert(s->private, dst, iq_data, samples));
+	}
+	
+	memcpy(dst, iq_data, sizeof(int16_t) * 2 * samples);
+	
+	return(0);
+}
+
+int rf_write_native(struct rf_t *s, const void *data, int samples)
 {
 	if(s->write)
 	{
-		return(s->write(s->private, iq_data, samples));
+		return(s->write(s->private, data, samples));
+	}
+	
+	return(-1);
+}
+
+int rf_write(struct rf_t *s, const int16_t *iq_data, int samples)
+{
+	uint8_t data[16384];
+	int r, l;
+	
+	if(!s->convert)
+	{
+		return(rf_write_native(s, iq_data, samples));
+	}
+	
+	/* Convert and write in chunks */
+	for(r = 0; r == 0 && samples > 0; samples -= l)
+	{
+		l = sizeof(data) / rf_sample_size(s);
+		if(l > samples) l = samples;
+		
+		rf_convert(s, data, iq_data, l);
+		r = rf_write_native(s, data, l);
+		
+		iq_data += l * 2;
+	}
+	
+	return(r);
+}
+
+int rf_queued(struct rf_t *s)
+{
+	/* Returns the number of samples waiting in the sink,
+	 * or -1 if the sink can't tell */
+	if(s->queued)
+	{
+		return(s->queued(s->private));
 	}
 	
 	return(-1);
@@ -59,6 +124,36 @@ int rf_close(struct rf_t *s)
 	return(0);
 }
 
+static double _cycles(int64_t n, double r)
+{
+	double hi, lo;
+	
+	/* Returns the fractional part of n * r. n is split to
+	 * retain precision when it becomes very large */
+	hi = (double) (n >> 24) * fmod(r * 16777216.0, 1.0);
+	lo = (double) (n & 0xFFFFFF) * r;
+	
+	hi -= floor(hi);
+	lo -= floor(lo);
+	
+	return(hi + lo - floor(hi + lo));
+}
+
+static void _renorm(int32_t phase[2])
+{
+	double m;
+	
+	/* Pull the phasor amplitude back to INT32_MAX - INT16_MAX. The drift
+	 * is tiny, so one Newton step towards 1 / sqrt(m) is enough and
+	 * avoids calling atan2(), cos() and sin() */
+	m = ((double) phase[0] * phase[0] + (double) phase[1] * phase[1]);
+	m /= (double) (INT32_MAX - INT16_MAX) * (INT32_MAX - INT16_MAX);
+	m = (3.0 - m) * 0.5;
+	
+	phase[0] = lround(phase[0] * m);
+	phase[1] = lround(phase[1] * m);
+}
+
 static double _hamming(double x)
 {
 	if(x < -1 || x > 1) return(0);
@@ -96,6 +191,7 @@ void rf_qpsk_free(struct rf_qpsk_t *s)
 	free(s->iwin);
 	free(s->qwin);
 	free(s->taps);
+	free(s->lut);
 	memset(s, 0, sizeof(struct rf_qpsk_t));
 }
 
@@ -110,7 +206,9 @@ int rf_qpsk_init(struct rf_qpsk_t *s, unsigned int interpolation, unsigned int d
 	
 	/* Generate the taps */
 	ntaps = (5 * interpolation) | 1;
-	taps = calloc(sizeof(double), ntaps);
+	
+	/* With room for the zero padding up to a multiple of interpolation */
+	taps = calloc(sizeof(double), ntaps + interpolation);
 	if(!taps)
 	{
 		return(-1);
@@ -154,6 +252,28 @@ int rf_qpsk_init(struct rf_qpsk_t *s, unsigned int interpolation, unsigned int d
 	
 	free(taps);
 	
+	/* The symbols are only ever +/-1, so each output is one of
+	 * 2^ataps values for its phase. Tabulate them if that fits */
+	if(s->ataps <= 12 && (uint64_t) interpolation << s->ataps <= RF_QPSK_LUT_MAX)
+	{
+		s->lut = malloc(sizeof(int16_t) * ((size_t) interpolation << s->ataps));
+	}
+	
+	for(j = 0; s->lut && j < interpolation; j++)
+	{
+		for(i = 0; i < 1 << s->ataps; i++)
+		{
+			int32_t a = 0;
+			
+			for(x = 0; x < s->ataps; x++)
+			{
+				a += (i >> (s->ataps - 1 - x) & 1 ? 1 : -1) * s->taps[j * s->ataps + x];
+			}
+			
+			s->lut[((size_t) j << s->ataps) + i] = a < INT16_MIN ? INT16_MIN : (a > INT16_MAX ? INT16_MAX : a);
+		}
+	}
+	
 	return(0);
 }
 
@@ -203,90 +323,558 @@ int rf_qpsk_process(struct rf_qpsk_t *s, int16_t *out, const uint8_t *src, int s
 	return(z);
 }
 
+void rf_qpsk_unpack(int16_t *isym, int16_t *qsym, const uint8_t *src, int syms)
+{
+	int x, sym;
+	
+	/* Unpack 2-bit symbols into +/-1 values for rf_qpsk_render() */
+	for(x = 0; x < syms * 2; x += 2)
+	{
+		sym = (src[x >> 3] >> (6 - (x & 0x07))) & 0x03;
+		*(isym++) = (sym & 2 ? 1 : -1);
+		*(qsym++) = (sym & 1 ? 1 : -1);
+	}
+}
+
+int64_t rf_qpsk_symbol(const struct rf_qpsk_t *s, int64_t sample)
+{
+	/* Returns the index of the newest symbol used by an output sample */
+	return(sample * s->decimation / s->interpolation);
+}
+
+int64_t rf_qpsk_samples(const struct rf_qpsk_t *s, int64_t syms)
+{
+	/* Returns the number of output samples the first syms symbols produce */
+	return((syms * s->interpolation + s->decimation - 1) / s->decimation);
+}
+
+static unsigned int _qpsk_pattern(const int16_t *win, unsigned int n)
+{
+	unsigned int p = 0;
+	
+	while(n--)
+	{
+		p = (p << 1) | (*(win++) > 0);
+	}
+	
+	return(p);
+}
+
+int rf_qpsk_render(const struct rf_qpsk_t *s, int16_t *out, const int16_t *isym, const int16_t *qsym, int64_t sym0, int64_t sample, int samples, unsigned int span)
+{
+	const int16_t *taps;
+	const int16_t *iwin, *qwin, *lut;
+	const unsigned int mask = (1 << s->ataps) - 1;
+	unsigned int ip, qp;
+	int32_t ai, aq;
+	int64_t m, n;
+	unsigned int d, skip;
+	int x, y;
+	
+	/* Render output samples starting at any point in the stream. The
+	 * symbol arrays hold +/-1 (or 0 before the start of the stream),
+	 * with element 0 being symbol sym0. The newest symbol for each
+	 * output sample and the ataps - 1 symbols before it must be present.
+	 * 
+	 * Only the middle span symbols of the filter are used, keeping the
+	 * same delay. With span = ataps the result is identical to
+	 * rf_qpsk_process(), shorter spans are cheaper but less accurate.
+	 * 
+	 * With a pattern table each sample is two lookups, cheaper than
+	 * even a short span, so the whole filter is always used */
+	
+	if(span > s->ataps || s->lut) span = s->ataps;
+	skip = (s->ataps - span) / 2;
+	
+	m = sample * s->decimation;
+	d = m % s->interpolation;
+	m = m / s->interpolation - sym0 - (s->ataps - 1) + skip;
+	
+	/* The patterns of the window of the first sample. They are only
+	 * valid once the window is clear of the start of the stream */
+	ip = _qpsk_pattern(&isym[m], s->ataps);
+	qp = _qpsk_pattern(&qsym[m], s->ataps);
+	n = m;
+	
+	for(x = 0; x < samples; x++)
+	{
+		/* Shift any new symbols into the patterns */
+		for(; n < m; n++)
+		{
+			ip = ((ip << 1) | (isym[n + s->ataps] > 0)) & mask;
+			qp = ((qp << 1) | (qsym[n + s->ataps] > 0)) & mask;
+		}
+		
+		if(s->lut && m + sym0 >= 0)
+		{
+			lut = &s->lut[(size_t) d << s->ataps];
+			*(out++) = lut[ip];
+			*(out++) = lut[qp];
+		}
+		else
+		{
+			iwin = &isym[m];
+			qwin = &qsym[m];
+			taps = &s->taps[d * s->ataps + skip];
+			
+			/* Calculate the next output sample */
+			for(ai = aq = y = 0; y < span; y++)
+			{
+				ai += iwin[y] * taps[y];
+				aq += qwin[y] * taps[y];
+			}
+			
+			*(out++) = ai < INT16_MIN ? INT16_MIN : (ai > INT16_MAX ? INT16_MAX : ai);
+			*(out++) = aq < INT16_MIN ? INT16_MIN : (aq > INT16_MAX ? INT16_MAX : aq);
+		}
+		
+		for(d += s->decimation; d >= s->interpolation; d -= s->interpolation)
+		{
+			m++;
+		}
+	}
+	
+	return(samples);
+}
+
+/* cos and sin at the middle of each step of phase, shared by every
+ * FM modulator. Each applies its own level to the output */
+static int16_t _fm_lut[2 << RF_FM_LUT_BITS];
+static pthread_once_t _fm_lut_once = PTHREAD_ONCE_INIT;
+
+static void _fm_lut_init(void)
+{
+	double d;
+	int r;
+	
+	for(r = 0; r < 1 << RF_FM_LUT_BITS; r++)
+	{
+		d = 2.0 * M_PI * (r + 0.5) / (1 << RF_FM_LUT_BITS);
+		
+		_fm_lut[r * 2 + 0] = lround(cos(d) * INT16_MAX);
+		_fm_lut[r * 2 + 1] = lround(sin(d) * INT16_MAX);
+	}
+}
+
 void rf_fm_free(struct rf_fm_t *s)
 {
-	free(s->lut);
+	/* Nothing to do */
+}
+
+static uint64_t _fraction(double c)
+{
+	/* A fraction of a cycle in 64-bit fixed point */
+	c -= floor(c);
+	c = ldexp(c, 64);
+	
+	return(c < 18446744073709551616.0 ? (uint64_t) c : 0);
 }
 
 /* deviation = peak deviation in Hz (+/-) from frequency */
 int rf_fm_init(struct rf_fm_t *s, unsigned int sample_rate, double frequency, double deviation, double level, int complex_out)
 {
-	int r;
-	double d;
-	
 	memset(s, 0, sizeof(struct rf_fm_t));
 	
+	pthread_once(&_fm_lut_once, _fm_lut_init);
+	
 	s->complex_out = complex_out ? 1 : 0;
 	s->level = round(INT16_MAX * level);
-	s->counter = INT16_MAX;
-	s->phase[0] = INT32_MAX - INT16_MAX;
-	s->phase[1] = 0;
-	s->lut = malloc(sizeof(int32_t) * 2 * (UINT16_MAX + 1));
-	if(!s->lut)
+	s->fc = frequency / sample_rate;
+	s->fd = deviation / INT16_MAX / sample_rate;
+	s->step = _fraction(s->fc);
+	s->dstep = (uint64_t) llround(ldexp(s->fd, 64));
+	
+	return(0);
+}
+
+void rf_fm_seek(struct rf_fm_t *s, int64_t sample, int64_t sum)
+{
+	/* Set the phase to where it should be before the given sample,
+	 * where sum is the total of all the input samples before it */
+	s->phase = _fraction(_cycles(sample, s->fc) + _cycles(sum, s->fd));
+}
+
+/* The phase is the running total of the carrier and input steps,
+ * wrapping each cycle, so there is no recurrence on the output to
+ * drift or be renormalised. Its top bits pick the nearest table
+ * entry and the next 21 the offset e from it, in radians << 23.
+ * 1608 / 2^16 is 2^(23 - 21) * 2 * pi / 2^RF_FM_LUT_BITS.
+ * cos(a + e) is about cos(a) - e * sin(a), within 0.2 LSB,
+ * before the level is applied */
+
+static int16_t *_fm_out(const struct rf_fm_t *s, int16_t *out, uint64_t p)
+{
+	const int16_t *d = &_fm_lut[(p >> (64 - RF_FM_LUT_BITS)) * 2];
+	int32_t e, i, q;
+	
+	e = ((int32_t) (p >> (43 - RF_FM_LUT_BITS) & 0x1FFFFF) - 0x100000) * 1608 >> 16;
+	
+	i = d[0] - ((d[1] * e + 0x400000) >> 23);
+	*(out++) = (i * s->level + 0x4000) >> 15;
+	
+	if(s->complex_out)
 	{
-		return(-1);
+		q = d[1] + ((d[0] * e + 0x400000) >> 23);
+		*(out++) = (q * s->level + 0x4000) >> 15;
 	}
 	
-	for(r = INT16_MIN; r <= INT16_MAX; r++)
+	return(out);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static inline void _fm_out_avx2(const struct rf_fm_t *s, int16_t *out, __m256i x)
+{
+	const __m256i pick = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+	const __m128i r = _mm_set1_epi32(0x400000);
+	const __m128i l = _mm_set1_epi16(s->level);
+	__m256i t;
+	__m128i k, e, g, c, sn, i, q;
+	
+	/* The outputs at four phases, as _fm_out() */
+	t = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(x, 64 - RF_FM_LUT_BITS), pick);
+	k = _mm256_castsi256_si128(t);
+	
+	t = _mm256_permutevar8x32_epi32(_mm256_srli_epi64(x, 43 - RF_FM_LUT_BITS), pick);
+	e = _mm_and_si128(_mm256_castsi256_si128(t), _mm_set1_epi32(0x1FFFFF));
+	e = _mm_sub_epi32(e, _mm_set1_epi32(0x100000));
+	e = _mm_srai_epi32(_mm_mullo_epi32(e, _mm_set1_epi32(1608)), 16);
+	
+	/* Each entry is a cos, sin pair of 16-bit values. The level is
+	 * applied with mulhrs, (x * level + 0x4000) >> 15 */
+	g = _mm_i32gather_epi32((const int *) _fm_lut, k, 4);
+	c = _mm_srai_epi32(_mm_slli_epi32(g, 16), 16);
+	sn = _mm_srai_epi32(g, 16);
+	
+	i = _mm_sub_epi32(c, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(sn, e), r), 23));
+	
+	if(s->complex_out)
 	{
-		d = 2.0 * M_PI / sample_rate * (frequency + (double) r / INT16_MAX * deviation);
+		q = _mm_add_epi32(sn, _mm_srai_epi32(_mm_add_epi32(_mm_mullo_epi32(c, e), r), 23));
+		i = _mm_or_si128(_mm_and_si128(i, _mm_set1_epi32(0xFFFF)), _mm_slli_epi32(q, 16));
+		_mm_storeu_si128((__m128i *) out, _mm_mulhrs_epi16(i, l));
+	}
+	else
+	{
+		_mm_storel_epi64((__m128i *) out, _mm_mulhrs_epi16(_mm_packs_epi32(i, i), l));
+	}
+}
+
+__attribute__((target("avx2")))
+static unsigned int _fm_process_avx2(struct rf_fm_t *s, int16_t *out, const int16_t *in, unsigned int samples)
+{
+	__m256i p, x, t, u, dlo, dhi, base;
+	uint64_t v[4];
+	unsigned int n;
+	
+	/* Four samples at a time. The input is biased to be unsigned,
+	 * so each step is base + u * dstep from two 32-bit multiplies,
+	 * then the steps are summed across the lanes onto the phase */
+	base = _mm256_set1_epi64x(s->step - 32768 * s->dstep);
+	dlo = _mm256_set1_epi64x(s->dstep & 0xFFFFFFFF);
+	dhi = _mm256_set1_epi64x(s->dstep >> 32);
+	p = _mm256_set1_epi64x(s->phase);
+	
+	for(n = 0; n + 4 <= samples; n += 4)
+	{
+		u = _mm256_cvtepi16_epi64(_mm_loadl_epi64((const __m128i *) &in[n]));
+		u = _mm256_add_epi64(u, _mm256_set1_epi64x(32768));
+		
+		x = _mm256_add_epi64(base, _mm256_mul_epu32(u, dlo));
+		x = _mm256_add_epi64(x, _mm256_slli_epi64(_mm256_mul_epu32(u, dhi), 32));
 		
-		s->lut[(r - INT16_MIN) * 2 + 0] = lround(cos(d) * INT32_MAX);
-		s->lut[(r - INT16_MIN) * 2 + 1] = lround(sin(d) * INT32_MAX);
+		x = _mm256_add_epi64(x, _mm256_slli_si256(x, 8));
+		t = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(1, 1, 0, 0));
+		x = _mm256_add_epi64(x, _mm256_blend_epi32(_mm256_setzero_si256(), t, 0xF0));
+		
+		x = _mm256_add_epi64(p, x);
+		p = _mm256_permute4x64_epi64(x, _MM_SHUFFLE(3, 3, 3, 3));
+		
+		_fm_out_avx2(s, &out[n * (1 + s->complex_out)], x);
 	}
 	
-	return(0);
+	_mm256_storeu_si256((__m256i *) v, p);
+	s->phase = v[0];
+	
+	return(n);
 }
 
+__attribute__((target("avx2")))
+static unsigned int _fm_ramp_avx2(struct rf_fm_t *s, int16_t *out, uint64_t inc, uint64_t dinc, unsigned int samples)
+{
+	__m256i p, d, dd;
+	uint64_t q = s->phase;
+	unsigned int n;
+	
+	/* Four samples at a time. Each lane moves on by the steps of
+	 * the next four samples, 4 * inc + (4m + 10) * dinc for sample
+	 * m, which itself rises by 16 * dinc */
+	p = _mm256_setr_epi64x(q + inc, q + 2 * inc + dinc, q + 3 * inc + 3 * dinc, q + 4 * inc + 6 * dinc);
+	d = _mm256_setr_epi64x(4 * inc + 10 * dinc, 4 * inc + 14 * dinc, 4 * inc + 18 * dinc, 4 * inc + 22 * dinc);
+	dd = _mm256_set1_epi64x(16 * dinc);
+	
+	for(n = 0; n + 4 <= samples; n += 4)
+	{
+		_fm_out_avx2(s, &out[n * (1 + s->complex_out)], p);
+		
+		p = _mm256_add_epi64(p, d);
+		d = _mm256_add_epi64(d, dd);
+	}
+	
+	/* Runs are often short, so the last few samples are
+	 * done here too rather than in the scalar loop */
+	if(n < samples)
+	{
+		int16_t t[8];
+		
+		_fm_out_avx2(s, t, p);
+		memcpy(&out[n * (1 + s->complex_out)], t, sizeof(int16_t) * (samples - n) * (1 + s->complex_out));
+		n = samples;
+	}
+	
+	return(n);
+}
+
+#endif
+
 int rf_fm_process(struct rf_fm_t *s, int16_t *out, const int16_t *in, unsigned int samples)
 {
-	int64_t i, q;
-	const int32_t *d;
+	uint64_t p;
+	
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		unsigned int n = _fm_process_avx2(s, out, in, samples);
+		
+		out += n * (1 + s->complex_out);
+		in += n;
+		samples -= n;
+	}
+#endif
+	
+	p = s->phase;
 	
 	while(samples--)
 	{
-		d = &s->lut[(*(in++) - INT16_MIN) * 2];
-		i = (((int64_t) s->phase[0] * (int64_t) d[0] - (int64_t) s->phase[1] * (int64_t) d[1]) + 0x3FFFFFFF) >> 31;
-		q = (((int64_t) s->phase[0] * (int64_t) d[1] + (int64_t) s->phase[1] * (int64_t) d[0]) + 0x3FFFFFFF) >> 31;
+		p += s->step + (uint64_t) *(in++) * s->dstep;
+		out = _fm_out(s, out, p);
+	}
+	
+	s->phase = p;
+	
+	return(0);
+}
+
+static void _fm_steps(const struct rf_fm_t *s, double x, double dx, uint64_t *inc, uint64_t *dinc)
+{
+	/* The first step and its change per sample for an input
+	 * starting at x and rising by dx each sample */
+	*inc = s->step + (uint64_t) (int64_t) (x * (int64_t) s->dstep);
+	*dinc = (uint64_t) (int64_t) (dx * (int64_t) s->dstep);
+}
+
+int rf_fm_ramp(struct rf_fm_t *s, int16_t *out, double x, double dx, unsigned int samples)
+{
+	uint64_t p, inc, dinc;
+	unsigned int n;
+	
+	/* Modulate an input that starts at x and rises by dx each
+	 * sample, without the input samples themselves. The step
+	 * rises by a fixed dinc, so each sample is two additions
+	 * and a lookup. A constant input is a fixed rotation */
+	_fm_steps(s, x, dx, &inc, &dinc);
+	n = 0;
+	
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
+	{
+		n = _fm_ramp_avx2(s, out, inc, dinc, samples);
 		
-		s->phase[0] = i;
-		s->phase[1] = q;
+		/* Move on as the scalar loop would have */
+		s->phase += n * inc + (uint64_t) n * (n - 1) / 2 * dinc;
+		inc += n * dinc;
 		
-		if(s->complex_out)
+		out += n * (1 + s->complex_out);
+	}
+#endif
+	
+	for(p = s->phase; n < samples; n++)
+	{
+		p += inc;
+		inc += dinc;
+		out = _fm_out(s, out, p);
+	}
+	
+	s->phase = p;
+	
+	return(0);
+}
+
+void rf_fm_bank_init(struct rf_fm_bank_t *s)
+{
+	memset(s, 0, sizeof(struct rf_fm_bank_t));
+}
+
+void rf_fm_bank_set(struct rf_fm_bank_t *s, int lane, const struct rf_fm_t *fm)
+{
+	/* Load a modulator's phase and level into a lane, with a
+	 * constant zero input. A NULL modulator silences the lane */
+	s->phase[lane] = fm ? fm->phase : 0;
+	s->step[lane] = fm ? fm->step : 0;
+	s->dstep[lane] = 0;
+	s->level[lane] = fm ? fm->level : 0;
+}
+
+void rf_fm_bank_ramp(struct rf_fm_bank_t *s, int lane, const struct rf_fm_t *fm, double x, double dx)
+{
+	/* Set the input of a lane, as rf_fm_ramp() */
+	_fm_steps(fm, x, dx, &s->step[lane], &s->dstep[lane]);
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static inline __m256i _fm_bank_out_avx2(__m256i *p0, __m256i *p1, __m256i *i0, __m256i *i1, __m256i d0, __m256i d1, __m256i l)
+{
+	const __m256i r = _mm256_set1_epi32(0x400000);
+	__m256i h, k, e, g, c, sn, i;
+	
+	*p0 = _mm256_add_epi64(*p0, *i0);
+	*p1 = _mm256_add_epi64(*p1, *i1);
+	*i0 = _mm256_add_epi64(*i0, d0);
+	*i1 = _mm256_add_epi64(*i1, d1);
+	
+	/* The top half of each phase is enough for the table index
+	 * and offset, so the two sets of four lanes are merged into
+	 * one set of eight, in the order 0, 4, 1, 5, 2, 6, 3, 7 */
+	h = _mm256_blend_epi32(_mm256_srli_epi64(*p0, 32), *p1, 0xAA);
+	
+	k = _mm256_srli_epi32(h, 32 - RF_FM_LUT_BITS);
+	e = _mm256_and_si256(_mm256_srli_epi32(h, 11 - RF_FM_LUT_BITS), _mm256_set1_epi32(0x1FFFFF));
+	e = _mm256_sub_epi32(e, _mm256_set1_epi32(0x100000));
+	e = _mm256_srai_epi32(_mm256_mullo_epi32(e, _mm256_set1_epi32(1608)), 16);
+	
+	g = _mm256_i32gather_epi32((const int *) _fm_lut, k, 4);
+	c = _mm256_srai_epi32(_mm256_slli_epi32(g, 16), 16);
+	sn = _mm256_srai_epi32(g, 16);
+	
+	i = _mm256_sub_epi32(c, _mm256_srai_epi32(_mm256_add_epi32(_mm256_mullo_epi32(sn, e), r), 23));
+	i = _mm256_mullo_epi32(i, l);
+	
+	return(_mm256_srai_epi32(_mm256_add_epi32(i, _mm256_set1_epi32(0x4000)), 15));
+}
+
+__attribute__((target("avx2")))
+static void _fm_bank_process_avx2(struct rf_fm_bank_t *s, int32_t *out, unsigned int samples)
+{
+	__m256i p0, p1, i0, i1, d0, d1, l, v[8], a, b;
+	int32_t t[8];
+	unsigned int n, j, m;
+	
+	p0 = _mm256_loadu_si256((const __m256i *) &s->phase[0]);
+	p1 = _mm256_loadu_si256((const __m256i *) &s->phase[4]);
+	i0 = _mm256_loadu_si256((const __m256i *) &s->step[0]);
+	i1 = _mm256_loadu_si256((const __m256i *) &s->step[4]);
+	d0 = _mm256_loadu_si256((const __m256i *) &s->dstep[0]);
+	d1 = _mm256_loadu_si256((const __m256i *) &s->dstep[4]);
+	
+	l = _mm256_loadu_si256((const __m256i *) s->level);
+	l = _mm256_permutevar8x32_epi32(l, _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7));
+	
+	/* Eight samples of all eight lanes at a time. Their totals
+	 * are found together by adding neighbouring pairs three
+	 * times over, then added to the output */
+	for(n = 0; n < samples; n += 8)
+	{
+		m = samples - n < 8 ? samples - n : 8;
+		
+		for(j = 0; j < 8; j++)
 		{
-			*(out++) = ((i >> 16) * s->level) >> 15;
-			*(out++) = ((q >> 16) * s->level) >> 15;
+			v[j] = j < m ? _fm_bank_out_avx2(&p0, &p1, &i0, &i1, d0, d1, l) : _mm256_setzero_si256();
+		}
+		
+		v[0] = _mm256_hadd_epi32(v[0], v[1]);
+		v[2] = _mm256_hadd_epi32(v[2], v[3]);
+		v[4] = _mm256_hadd_epi32(v[4], v[5]);
+		v[6] = _mm256_hadd_epi32(v[6], v[7]);
+		v[0] = _mm256_hadd_epi32(v[0], v[2]);
+		v[4] = _mm256_hadd_epi32(v[4], v[6]);
+		
+		a = _mm256_permute2x128_si256(v[0], v[4], 0x20);
+		b = _mm256_permute2x128_si256(v[0], v[4], 0x31);
+		a = _mm256_add_epi32(a, b);
+		
+		if(m == 8)
+		{
+			b = _mm256_loadu_si256((const __m256i *) &out[n]);
+			_mm256_storeu_si256((__m256i *) &out[n], _mm256_add_epi32(a, b));
 		}
 		else
 		{
-			*(out++) = ((i >> 16) * s->level) >> 15;
+			_mm256_storeu_si256((__m256i *) t, a);
+			for(j = 0; j < m; j++) out[n + j] += t[j];
 		}
-		
-		s->counter--;
 	}
 	
-	/* Correct the amplitude after INT16_MAX samples */
-	if(s->counter <= 0)
+	_mm256_storeu_si256((__m256i *) &s->phase[0], p0);
+	_mm256_storeu_si256((__m256i *) &s->phase[4], p1);
+	_mm256_storeu_si256((__m256i *) &s->step[0], i0);
+	_mm256_storeu_si256((__m256i *) &s->step[4], i1);
+}
+
+#endif
+
+void rf_fm_bank_process(struct rf_fm_bank_t *s, int32_t *out, unsigned int samples)
+{
+	const int16_t *d;
+	unsigned int n;
+	int32_t e, i;
+	int k;
+	
+#if defined(__x86_64__) || defined(__i386__)
+	if(cpu_features() & CPU_AVX2)
 	{
-		double ra = atan2(s->phase[1], s->phase[0]);
-		
-		s->phase[0] = lround(cos(ra) * (INT32_MAX - INT16_MAX));
-		s->phase[1] = lround(sin(ra) * (INT32_MAX - INT16_MAX));
-		
-		s->counter = INT16_MAX;
+		_fm_bank_process_avx2(s, out, samples);
+		return;
 	}
+#endif
 	
-	return(0);
+	/* Each lane as rf_fm_ramp(), with real output */
+	for(k = 0; k < RF_FM_LANES; k++)
+	{
+		if(s->level[k] == 0)
+		{
+			continue;
+		}
+		
+		for(n = 0; n < samples; n++)
+		{
+			s->phase[k] += s->step[k];
+			s->step[k] += s->dstep[k];
+			
+			d = &_fm_lut[(s->phase[k] >> (64 - RF_FM_LUT_BITS)) * 2];
+			e = ((int32_t) (s->phase[k] >> (43 - RF_FM_LUT_BITS) & 0x1FFFFF) - 0x100000) * 1608 >> 16;
+			i = d[0] - ((d[1] * e + 0x400000) >> 23);
+			
+			out[n] += (int16_t) ((i * s->level[k] + 0x4000) >> 15);
+		}
+	}
 }
 
 void rf_mixer_free(struct rf_mixer_t *s)
 {
-	/* Nothing to do */
+	free(s->lut);
+	s->lut = NULL;
 }
 
 int rf_mixer_init(struct rf_mixer_t *s, unsigned int sample_rate, double frequency, double level, int complex_out)
 {
 	double d;
+	int64_t f;
+	unsigned int i;
+	
+	memset(s, 0, sizeof(struct rf_mixer_t));
 	
 	s->level = round(INT16_MAX * level);
 	s->complex_out = complex_out ? 1 : 0;
@@ -299,14 +887,152 @@ int rf_mixer_init(struct rf_mixer_t *s, unsigned int sample_rate, double frequen
 	s->delta[0] = lround(cos(d) * INT32_MAX);
 	s->delta[1] = lround(sin(d) * INT32_MAX);
 	
+	s->fc = frequency / sample_rate;
+	
+	/* A whole number of Hz repeats every sample_rate / gcd samples.
+	 * If that's short enough, tabulate one period. Each entry is
+	 * worked out from its own phase so nothing drifts */
+	f = llround(frequency);
+	if(f == frequency)
+	{
+		s->period = sample_rate / rf_gcd(llabs(f), sample_rate);
+		
+		/* Very short periods are repeated to at least the padding,
+		 * so a read never runs more than one period past the end */
+		if(s->period < RF_MIXER_LUT_PAD)
+		{
+			s->period *= (RF_MIXER_LUT_PAD + s->period - 1) / s->period;
+		}
+	}
+	
+	if(s->period > 0 && s->period <= RF_MIXER_LUT_MAX)
+	{
+		s->lut = malloc(sizeof(int16_t) * 2 * (s->period + RF_MIXER_LUT_PAD));
+	}
+	
+	for(i = 0; s->lut && i < s->period + RF_MIXER_LUT_PAD; i++)
+	{
+		d = 2.0 * M_PI * ((f * (int64_t) (i % s->period)) % (int64_t) sample_rate) / sample_rate;
+		s->lut[i * 2 + 0] = lround(cos(d) * s->level);
+		s->lut[i * 2 + 1] = lround(sin(d) * s->level);
+	}
+	
 	return(0);
 }
 
+void rf_mixer_seek(struct rf_mixer_t *s, int64_t sample)
+{
+	double ra;
+	
+	if(s->lut)
+	{
+		/* Each output is mixed with the phase one step on from
+		 * its sample, as the recurrence below has it */
+		s->pos = ((sample + 1) % s->period + s->period) % s->period;
+		return;
+	}
+	
+	/* Set the phase to where it should be before the given sample */
+	ra = 2.0 * M_PI * _cycles(sample, s->fc);
+	
+	s->phase[0] = lround(cos(ra) * (INT32_MAX - INT16_MAX));
+	s->phase[1] = lround(sin(ra) * (INT32_MAX - INT16_MAX));
+	
+	s->counter = INT16_MAX;
+}
+
+#if defined(__x86_64__) || defined(__i386__)
+
+__attribute__((target("avx2")))
+static unsigned int _mixer_table_avx2(struct rf_mixer_t *s, int16_t *out, const int16_t *in, unsigned int samples)
+{
+	const __m256i neg = _mm256_set1_epi32(0xFFFF0001);
+	const __m256i r = _mm256_set1_epi32(0x3FFF);
+	const __m256i m = _mm256_set1_epi32(0xFFFF);
+	__m256i a, b, la, lb;
+	unsigned int n;
+	
+	/* Real output, sixteen samples at a time. The I/Q pairs of
+	 * the input and the table, with Q negated, are multiplied and
+	 * summed by madd. The result is truncated to 16 bits as in
+	 * the scalar loop rather than saturated. The padding after
+	 * the table lets each read run on past the end of a period */
+	for(n = 0; n + 16 <= samples; n += 16)
+	{
+		la = _mm256_loadu_si256((const __m256i *) &s->lut[s->pos * 2]);
+		s->pos += 8;
+		if(s->pos >= s->period) s->pos -= s->period;
+		
+		lb = _mm256_loadu_si256((const __m256i *) &s->lut[s->pos * 2]);
+		s->pos += 8;
+		if(s->pos >= s->period) s->pos -= s->period;
+		
+		a = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) &in[n * 2]), _mm256_sign_epi16(la, neg));
+		b = _mm256_madd_epi16(_mm256_loadu_si256((const __m256i *) &in[n * 2 + 16]), _mm256_sign_epi16(lb, neg));
+		
+		a = _mm256_and_si256(_mm256_srai_epi32(_mm256_add_epi32(a, r), 15), m);
+		b = _mm256_and_si256(_mm256_srai_epi32(_mm256_add_epi32(b, r), 15), m);
+		
+		a = _mm256_permute4x64_epi64(_mm256_packus_epi32(a, b), _MM_SHUFFLE(3, 1, 2, 0));
+		_mm256_storeu_si256((__m256i *) &out[n], a);
+	}
+	
+	return(n);
+}
+
+#endif
+
+static void _mixer_table(struct rf_mixer_t *s, int16_t *out, const int16_t *in, unsigned int samples)
+{
+	const int16_t *l;
+	int32_t i, q;
+	
+#if defined(__x86_64__) || defined(__i386__)
+	if(!s->complex_out && (cpu_features() & CPU_AVX2))
+	{
+		unsigned int n = _mixer_table_avx2(s, out, in, samples);
+		
+		out += n;
+		in += n * 2;
+		samples -= n;
+	}
+#endif
+	
+	/* Mix with one period of the signal, over and over */
+	while(samples--)
+	{
+		l = &s->lut[s->pos * 2];
+		if(++s->pos == s->period) s->pos = 0;
+		
+		i = l[0];
+		q = l[1];
+		
+		if(s->complex_out)
+		{
+			out[0] = (((int32_t) in[0] * i - (int32_t) in[1] * q) + 0x3FFF) >> 15;
+			out[1] = (((int32_t) in[0] * q + (int32_t) in[1] * i) + 0x3FFF) >> 15;
+			out += 2;
+		}
+		else
+		{
+			*(out++) = (((int32_t) in[0] * i - (int32_t) in[1] * q) + 0x3FFF) >> 15;
+		}
+		
+		in += 2;
+	}
+}
+
 int rf_mixer_process(struct rf_mixer_t *s, int16_t *out, const int16_t *in, unsigned int samples)
 {
 	int64_t i, q;
 	int32_t i2, q2;
 	
+	if(s->lut)
+	{
+		_mixer_table(s, out, in, samples);
+		return(0);
+	}
+	
 	while(samples--)
 	{
 		/* Update the mixer signal */
@@ -342,11 +1068,7 @@ int rf_mixer_process(struct rf_mixer_t *s, int16_t *out, const int16_t *in, unsi
 	/* Correct the amplitude after INT16_MAX samples */
 	if(s->counter <= 0)
 	{
-		double ra = atan2(s->phase[1], s->phase[0]);
-		
-		s->phase[0] = lround(cos(ra) * (INT32_MAX - INT16_MAX));
-		s->phase[1] = lround(sin(ra) * (INT32_MAX - INT16_MAX));
-		
+		_renorm(s->phase);
 		s->counter = INT16_MAX;
 	}
 	
@@ -16,6 +16,7 @@
 /* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
 
 #include <stdint.h>
+#include <stddef.h>
 
 #ifndef _RF_H
 #define _RF_H
@@ -35,15 +36,23 @@
 #define RF_PREEMPHASIS_J17   3
 
 /* Callback prototypes */
-typedef int (*rf_write_t)(void *private, int16_t *iq_data, int samples);
+typedef int (*rf_convert_t)(void *private, void *dst, const int16_t *iq_data, int samples);
+typedef int (*rf_write_t)(void *private, const void *data, int samples);
+typedef int (*rf_queued_t)(void *private);
 typedef int (*rf_close_t)(void *private);
 
 struct rf_t {
 	
 	void *private;
+	rf_convert_t convert;
 	rf_write_t write;
+	rf_queued_t queued;
 	rf_close_t close;
 	
+	/* Size of one complex sample in the sink's native format.
+	 * If no convert callback is set the sink takes int16 I/Q */
+	size_t sample_size;
+	
 	double scale;
 	int live;
 	
@@ -51,11 +60,19 @@ struct rf_t {
 
 extern double rf_scale(struct rf_t *s);
 extern int rf_live(struct rf_t *s);
-extern int rf_write(struct rf_t *s, int16_t *iq_data, int samples);
+extern size_t rf_sample_size(struct rf_t *s);
+extern int rf_convert(struct rf_t *s, void *dst, const int16_t *iq_data, int samples);
+extern int rf_write_native(struct rf_t *s, const void *data, int samples);
+extern int rf_write(struct rf_t *s, const int16_t *iq_data, int samples);
+extern int rf_queued(struct rf_t *s);
 extern int rf_close(struct rf_t *s);
 
 /* QPSK modulator (complex output) */
 
+/* Largest QPSK pattern table, in entries (128 KB). This is enough
+ * for the 1024 phases of a six symbol filter */
+#define RF_QPSK_LUT_MAX (1 << 16)
+
 struct rf_qpsk_t {
 	
 	unsigned int interpolation;
@@ -65,6 +82,10 @@ struct rf_qpsk_t {
 	unsigned int ataps;
 	int16_t *taps;
 	
+	/* The output for every pattern of ataps symbols, for each phase.
+	 * Bit 0 of the pattern is the newest symbol, set for +1 */
+	int16_t *lut;
+	
 	/* Output window */
 	unsigned int owin;
 	unsigned int lwin;
@@ -80,25 +101,67 @@ struct rf_qpsk_t {
 extern void rf_qpsk_free(struct rf_qpsk_t *s);
 extern int rf_qpsk_init(struct rf_qpsk_t *s, unsigned int interpolation, unsigned int decimation, double level);
 extern int rf_qpsk_process(struct rf_qpsk_t *s, int16_t *out, const uint8_t *src, int syms);
+extern void rf_qpsk_unpack(int16_t *isym, int16_t *qsym, const uint8_t *src, int syms);
+extern int64_t rf_qpsk_symbol(const struct rf_qpsk_t *s, int64_t sample);
+extern int64_t rf_qpsk_samples(const struct rf_qpsk_t *s, int64_t syms);
+extern int rf_qpsk_render(const struct rf_qpsk_t *s, int16_t *out, const int16_t *isym, const int16_t *qsym, int64_t sym0, int64_t sample, int samples, unsigned int span);
 
 /* FM modulator (complex / real output) */
+
+/* Bits of phase used to look up the FM output */
+#define RF_FM_LUT_BITS 10
+
 struct rf_fm_t {
 	
 	int complex_out;
 	
 	int16_t level;
-	int32_t counter;
-	int32_t phase[2];
-	int32_t *lut;
+	
+	/* The phase, and the step per sample for the carrier and per
+	 * unit of input, as 64-bit fractions of a cycle */
+	uint64_t phase;
+	uint64_t step;
+	uint64_t dstep;
+	
+	/* Cycles per sample for the carrier and per unit of input */
+	double fc;
+	double fd;
 	
 };
 
 extern void rf_fm_free(struct rf_fm_t *s);
 extern int rf_fm_init(struct rf_fm_t *s, unsigned int sample_rate, double frequency, double deviation, double level, int complex_out);
+extern void rf_fm_seek(struct rf_fm_t *s, int64_t sample, int64_t sum);
 extern int rf_fm_process(struct rf_fm_t *s, int16_t *out, const int16_t *in, unsigned int samples);
+extern int rf_fm_ramp(struct rf_fm_t *s, int16_t *out, double x, double dx, unsigned int samples);
+
+/* FM modulator bank (real output, summed) */
+
+#define RF_FM_LANES 8
+
+struct rf_fm_bank_t {
+	
+	/* The phase, step and change in step per sample of each lane,
+	 * as rf_fm_ramp(), and its level. A lane with level 0 is unused */
+	uint64_t phase[RF_FM_LANES];
+	uint64_t step[RF_FM_LANES];
+	uint64_t dstep[RF_FM_LANES];
+	int32_t level[RF_FM_LANES];
+	
+};
+
+extern void rf_fm_bank_init(struct rf_fm_bank_t *s);
+extern void rf_fm_bank_set(struct rf_fm_bank_t *s, int lane, const struct rf_fm_t *fm);
+extern void rf_fm_bank_ramp(struct rf_fm_bank_t *s, int lane, const struct rf_fm_t *fm, double x, double dx);
+extern void rf_fm_bank_process(struct rf_fm_bank_t *s, int32_t *out, unsigned int samples);
 
 /* Mixer */
 
+/* Longest mixer period tabulated, in samples, and the number of
+ * samples repeated after it so a read can run past the end */
+#define RF_MIXER_LUT_MAX (1 << 16)
+#define RF_MIXER_LUT_PAD 8
+
 struct rf_mixer_t {
 	
 	int complex_out;
@@ -108,10 +171,21 @@ struct rf_mixer_t {
 	int32_t phase[2];
 	int32_t delta[2];
 	
+	/* Cycles per sample */
+	double fc;
+	
+	/* One period of the mixer signal as I/Q pairs at the output
+	 * level, when the frequency repeats within RF_MIXER_LUT_MAX
+	 * samples, and the position of the next sample in it */
+	int16_t *lut;
+	unsigned int period;
+	unsigned int pos;
+	
 };
 
 extern void rf_mixer_free(struct rf_mixer_t *s);
 extern int rf_mixer_init(struct rf_mixer_t *s, unsigned int sample_rate, double frequency, double level, int complex_out);
+extern void rf_mixer_seek(struct rf_mixer_t *s, int64_t sample);
 extern int rf_mixer_process(struct rf_mixer_t *s, int16_t *out, const int16_t *in, unsigned int samples);
 
 /* Utils */
@@ -24,126 +24,78 @@
 /* File sink */
 typedef struct {
 	FILE *f;
-	void *data;
 	size_t data_size;
-	int samples;
 	int type;
 } rf_file_t;
 
-static int _rf_file_write_uint8(void *private, int16_t *iq_data, int samples)
+static int _rf_file_convert_uint8(void *private, void *dst, const int16_t *iq_data, int samples)
 {
-	rf_file_t *rf = private;
-	uint8_t *u8 = rf->data;
-	int i;
+	uint8_t *u8 = dst;
 	
-	while(samples)
+	for(samples *= 2; samples; samples--)
 	{
-		for(i = 0; i < rf->samples && i < samples; i++, iq_data += 2)
-		{
-			u8[i * 2 + 0] = (iq_data[0] - INT16_MIN) >> 8;
-			u8[i * 2 + 1] = (iq_data[1] - INT16_MIN) >> 8;
-		}
-		
-		fwrite(rf->data, rf->data_size, i, rf->f);
-		
-		samples -= i;
+		*(u8++) = (*(iq_data++) - INT16_MIN) >> 8;
 	}
 	
 	return(0);
 }
 
-static int _rf_file_write_int8(void *private, int16_t *iq_data, int samples)
+static int _rf_file_convert_int8(void *private, void *dst, const int16_t *iq_data, int samples)
 {
-	rf_file_t *rf = private;
-	int8_t *i8 = rf->data;
-	int i;
+	int8_t *i8 = dst;
 	
-	while(samples)
+	for(samples *= 2; samples; samples--)
 	{
-		for(i = 0; i < rf->samples && i < samples; i++, iq_data += 2)
-		{
-			i8[i * 2 + 0] = iq_data[0] >> 8;
-			i8[i * 2 + 1] = iq_data[1] >> 8;
-		}
-		
-		fwrite(rf->data, rf->data_size, i, rf->f);
-		
-		samples -= i;
+		*(i8++) = *(iq_data++) >> 8;
 	}
 	
 	return(0);
 }
 
-static int _rf_file_write_uint16(void *private, int16_t *iq_data, int samples)
+static int _rf_file_convert_uint16(void *private, void *dst, const int16_t *iq_data, int samples)
 {
-	rf_file_t *rf = private;
-	uint16_t *u16 = rf->data;
-	int i;
+	uint16_t *u16 = dst;
 	
-	while(samples)
+	for(samples *= 2; samples; samples--)
 	{
-		for(i = 0; i < rf->samples && i < samples; i++, iq_data += 2)
-		{
-			u16[i * 2 + 0] = (iq_data[0] - INT16_MIN);
-			u16[i * 2 + 1] = (iq_data[1] - INT16_MIN);
-		}
-		
-		fwrite(rf->data, rf->data_size, i, rf->f);
-		
-		samples -= i;
+		*(u16++) = (*(iq_data++) - INT16_MIN);
 	}
 	
 	return(0);
 }
 
-static int _rf_file_write_int16(void *private, int16_t *iq_data, int samples)
+static int _rf_file_convert_int32(void *private, void *dst, const int16_t *iq_data, int samples)
 {
-	rf_file_t *rf = private;
+	int32_t *i32 = dst;
 	
-	fwrite(iq_data, sizeof(int16_t) * 2, samples, rf->f);
+	for(samples *= 2; samples; samples--, iq_data++)
+	{
+		*(i32++) = (*iq_data << 16) + *iq_data;
+	}
 	
 	return(0);
 }
 
-static int _rf_file_write_int32(void *private, int16_t *iq_data, int samples)
+static int _rf_file_convert_float(void *private, void *dst, const int16_t *iq_data, int samples)
 {
-	rf_file_t *rf = private;
-	int32_t *i32 = rf->data;
-	int i;
+	float *f32 = dst;
 	
-	while(samples)
+	for(samples *= 2; samples; samples--)
 	{
-		for(i = 0; i < rf->samples && i < samples; i++, iq_data += 2)
-		{
-			i32[i * 2 + 0] = (iq_data[0] << 16) + iq_data[0];
-			i32[i * 2 + 1] = (iq_data[1] << 16) + iq_data[1];
-		}
-		
-		fwrite(rf->data, rf->data_size, i, rf->f);
-		
-		samples -= i;
+		*(f32++) = (float) *(iq_data++) * (1.0 / 32767.0);
 	}
 	
 	return(0);
 }
 
-static int _rf_file_write_float(void *private, int16_t *iq_data, int samples)
+static int _rf_file_write(void *private, const void *data, int samples)
 {
 	rf_file_t *rf = private;
-	float *f32 = rf->data;
-	int i;
 	
-	while(samples)
+	if(fwrite(data, rf->data_size, samples, rf->f) != samples)
 	{
-		for(i = 0; i < rf->samples && i < samples; i++, iq_data += 2)
-		{
-			f32[i * 2 + 0] = (float) iq_data[0] * (1.0 / 32767.0);
-			f32[i * 2 + 1] = (float) iq_data[1] * (1.0 / 32767.0);
-		}
-		
-		fwrite(rf->data, rf->data_size, i, rf->f);
-		
-		samples -= i;
+		perror("fwrite");
+		return(-1);
 	}
 	
 	return(0);
@@ -154,7 +106,6 @@ static int _rf_file_close(void *private)
 	rf_file_t *rf = private;
 	
 	if(rf->f && rf->f != stdout) fclose(rf->f);
-	if(rf->data) free(rf->data);
 	free(rf);
 	
 	return(0);
@@ -212,32 +163,20 @@ int rf_file_open(struct rf_t *s, const char *filename, int type, int live)
 	/* Double the size for complex types */
 	rf->data_size *= 2;
 	
-	rf->samples = 1024;
-	
-	/* Allocate the memory, unless the output is int16 */
-	if(rf->type != RF_INT16)
-	{
-		rf->data = malloc(rf->data_size * rf->samples);
-		if(!rf->data)
-		{
-			perror("malloc");
-			_rf_file_close(rf);
-			return(-1);
-		}
-	}
-	
 	/* Register the callback functions */
 	s->private = rf;
+	s->write = _rf_file_write;
 	s->close = _rf_file_close;
+	s->sample_size = rf->data_size;
 	
 	switch(type)
 	{
-	case RF_UINT8:  s->write = _rf_file_write_uint8;  break;
-	case RF_INT8:   s->write = _rf_file_write_int8;   break;
-	case RF_UINT16: s->write = _rf_file_write_uint16; break;
-	case RF_INT16:  s->write = _rf_file_write_int16;  break;
-	case RF_INT32:  s->write = _rf_file_write_int32;  break;
-	case RF_FLOAT:  s->write = _rf_file_write_float;  break;
+	case RF_UINT8:  s->convert = _rf_file_convert_uint8;  break;
+	case RF_INT8:   s->convert = _rf_file_convert_int8;   break;
+	case RF_UINT16: s->convert = _rf_file_convert_uint16; break;
+	case RF_INT16:  s->convert = NULL;                    break;
+	case RF_INT32:  s->convert = _rf_file_convert_int32;  break;
+	case RF_FLOAT:  s->convert = _rf_file_convert_float;  break;
 	}
 	
 	/* Is the output live? */
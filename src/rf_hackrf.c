@@ -21,10 +21,16 @@
 #include <libhackrf/hackrf.h>
 #include <pthread.h>
 #include <unistd.h>
+#include <stdatomic.h>
 #include "rf.h"
 
 #define BUFFERS 32
 
+/* Size of each libhackrf USB transfer, in bytes. The output buffers
+ * hold at least MIN_TRANSFERS of these so a transfer can be filled */
+#define TRANSFER_SIZE 262144
+#define MIN_TRANSFERS 2
+
 struct buffer_t {
 	
 	/* Buffers are locked while reading/writing */
@@ -53,6 +59,9 @@ struct buffers_t {
 	int in;
 	int out;
 	
+	/* Bytes waiting to be sent */
+	atomic_long queued;
+	
 };
 
 struct hackrf_t {
@@ -71,6 +80,7 @@ static int _buffer_init(struct buffers_t *buffers, size_t count, size_t length)
 	
 	buffers->count = count;
 	buffers->length = length;
+	atomic_init(&buffers->queued, 0);
 	buffers->buffers = calloc(count, sizeof(struct buffer_t));
 	
 	for(i = 0; i < count; i++)
@@ -145,11 +155,12 @@ static int _buffer_read(struct buffers_t *buffers, void *dst, size_t length)
 	memcpy(dst, buf->data + buf->start, length);
 	buf->start += length;
 	buf->length -= length;
+	atomic_fetch_sub(&buffers->queued, length);
 	
 	return(length);
 }
 
-static int _buffer_write(struct buffers_t *buffers, void *src, size_t length)
+static int _buffer_write(struct buffers_t *buffers, const void *src, size_t length)
 {
 	struct buffer_t *buf = &buffers->buffers[buffers->in];
 	int i;
@@ -177,6 +188,7 @@ static int _buffer_write(struct buffers_t *buffers, void *src, size_t length)
 	
 	memcpy(buf->data + i, src, length);
 	buf->length += length;
+	atomic_fetch_add(&buffers->queued, length);
 
 	return(length);
 }
@@ -208,38 +220,44 @@ static int _tx_callback(hackrf_transfer *transfer)
 	return(0);
 }
 
-static int _rf_write(void *private, int16_t *iq_data, int samples)
+static int _rf_convert(void *private, void *dst, const int16_t *iq_data, int samples)
+{
+	int8_t *iq8 = dst;
+	
+	for(samples *= 2; samples; samples--)
+	{
+		*(iq8++) = *(iq_data++) >> 8;
+	}
+	
+	return(0);
+}
+
+static int _rf_write(void *private, const void *data, int samples)
 {
 	struct hackrf_t *rf = private;
-	int8_t iq8[4096];
-	int i, r, b;
+	const int8_t *iq8 = data;
+	int r;
 	
 	samples *= 2;
 	
 	while(samples > 0)
 	{
-		b = samples;
-		if(b > 4096) b = 4096;
-		
-		for(i = 0; i < b; i++)
-		{
-			iq8[i] = *(iq_data++) >> 8;
-			samples--;
-		}
+		r = _buffer_write(&rf->buffers, iq8, samples);
 		
-		i = 0;
-		while(b)
-		{
-			r = _buffer_write(&rf->buffers, &iq8[i], b);
-			
-			b -= r;
-			i += r;
-		}
+		samples -= r;
+		iq8 += r;
 	}
 	
 	return(0);
 }
 
+static int _rf_queued(void *private)
+{
+	struct hackrf_t *rf = private;
+	
+	return(atomic_load(&rf->buffers.queued) / 2);
+}
+
 static int _rf_close(void *private)
 {
 	struct hackrf_t *rf = private;
@@ -272,12 +290,21 @@ static int _rf_close(void *private)
 	return(0);
 }
 
-int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t frequency_hz, unsigned int txvga_gain, unsigned char amp_enable)
+int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t frequency_hz, unsigned int txvga_gain, unsigned char amp_enable, int buffer_ms)
 {
 	struct hackrf_t *rf;
+	int64_t length;
 	int r;
 	
-	fprintf(stderr, "opening hackrf (%s, sr: %d, hz: %lu, gain: %u, amp: %s)\n", serial ? serial : "default", sample_rate, frequency_hz, txvga_gain, amp_enable ? "enabled" : "disabled");
+	/* Allocate buffer_ms milliseconds for output buffers, but
+	 * never less than the minimum number of transfers */
+	length = (int64_t) sample_rate * 2 * buffer_ms / 1000;
+	if(length < TRANSFER_SIZE * MIN_TRANSFERS)
+	{
+		length = TRANSFER_SIZE * MIN_TRANSFERS;
+	}
+	
+	fprintf(stderr, "opening hackrf (%s, sr: %d, hz: %lu, gain: %u, amp: %s, buffer: %.1f ms)\n", serial ? serial : "default", sample_rate, frequency_hz, txvga_gain, amp_enable ? "enabled" : "disabled", length * 1000.0 / 2 / sample_rate);
 	
 	rf = calloc(1, sizeof(struct hackrf_t));
 	if(!rf)
@@ -285,8 +312,7 @@ int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t
 		return(-1);
 	}
 	
-	/* Allocate 0.5 seconds for output buffers */
-	_buffer_init(&rf->buffers, BUFFERS, sample_rate * 2 / BUFFERS);
+	_buffer_init(&rf->buffers, BUFFERS, length / BUFFERS);
 	
 	/* Prepare the HackRF for output */
 	r = hackrf_init();
@@ -355,8 +381,11 @@ int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t
 	
 	/* Register the callback functions */
 	s->private = rf;
+	s->convert = _rf_convert;
 	s->write = _rf_write;
+	s->queued = _rf_queued;
 	s->close = _rf_close;
+	s->sample_size = sizeof(int8_t) * 2;
 	
 	/* Output is live */
 	s->live = 1;
@@ -18,7 +18,7 @@
 #ifndef _HACKRF_H
 #define _HACKRF_H
 
-extern int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t frequency_hz, unsigned int txvga_gain, unsigned char amp_enable);
+extern int rf_hackrf_open(struct rf_t *s, const char *serial, int sample_rate, uint64_t frequency_hz, unsigned int txvga_gain, unsigned char amp_enable, int buffer_ms);
 
 #endif
 
@@ -32,9 +32,10 @@ struct soapysdr_t {
 	
 };
 
-static int _rf_write(void *private, int16_t *iq_data, int samples)
+static int _rf_write(void *private, const void *data, int samples)
 {
 	struct soapysdr_t *rf = private;
+	const int16_t *iq_data = data;
 	const void *buffs[1];
 	int flags = 0;
 	int r;
@@ -174,7 +175,8 @@ int rf_soapysdr_open(struct rf_t *s, const char *device, unsigned int sample_rat
 	
 	SoapySDRDevice_activateStream(rf->d, rf->s, 0, 0, 0);
 	
-	/* Register the callback functions */
+	/* Register the callback functions. SoapySDR has no way to ask
+	 * how much is queued in the driver, so there is no queued */
 	s->private = rf;
 	s->write = _rf_write;
 	s->close = _rf_close;
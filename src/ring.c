@@ -0,0 +1,184 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sched.h>
+#include "ring.h"
+
+/* Number of times to yield before sleeping on the ring */
+#define RING_SPINS 64
+
+static int _ring_writable(struct ring_t *r)
+{
+	uint64_t head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	
+	return(head - atomic_load(&r->tail) < (uint64_t) r->slots ||
+		atomic_load(&r->closed));
+}
+
+static int _ring_readable(struct ring_t *r)
+{
+	uint64_t tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	
+	return(atomic_load(&r->head) != tail ||
+		atomic_load(&r->closed));
+}
+
+static void _ring_wait(struct ring_t *r, int (*ready)(struct ring_t *), int *spins)
+{
+	/* Yield for a short while before sleeping until the other side
+	 * moves. The flag is raised before testing again, so a commit or
+	 * release that misses it has already made the ring ready */
+	if(*spins < RING_SPINS)
+	{
+		(*spins)++;
+		sched_yield();
+		return;
+	}
+	
+	pthread_mutex_lock(&r->lock);
+	atomic_store(&r->waiting, 1);
+	
+	if(!ready(r))
+	{
+		pthread_cond_wait(&r->cond, &r->lock);
+	}
+	
+	pthread_mutex_unlock(&r->lock);
+}
+
+static void _ring_wake(struct ring_t *r)
+{
+	/* Only take the lock if the other side is asleep */
+	if(atomic_load(&r->waiting))
+	{
+		pthread_mutex_lock(&r->lock);
+		atomic_store(&r->waiting, 0);
+		pthread_cond_broadcast(&r->cond);
+		pthread_mutex_unlock(&r->lock);
+	}
+}
+
+int ring_init(struct ring_t *r, int slots, size_t size)
+{
+	memset(r, 0, sizeof(struct ring_t));
+	
+	r->slots = slots;
+	r->size = size;
+	r->data = malloc(size * slots);
+	if(!r->data)
+	{
+		return(-1);
+	}
+	
+	atomic_init(&r->head, 0);
+	atomic_init(&r->tail, 0);
+	atomic_init(&r->closed, 0);
+	atomic_init(&r->waiting, 0);
+	
+	pthread_mutex_init(&r->lock, NULL);
+	pthread_cond_init(&r->cond, NULL);
+	
+	return(0);
+}
+
+void ring_free(struct ring_t *r)
+{
+	if(r->data)
+	{
+		pthread_mutex_destroy(&r->lock);
+		pthread_cond_destroy(&r->cond);
+	}
+	
+	free(r->data);
+	memset(r, 0, sizeof(struct ring_t));
+}
+
+void *ring_write_acquire(struct ring_t *r)
+{
+	uint64_t head;
+	int spins = 0;
+	
+	head = atomic_load_explicit(&r->head, memory_order_relaxed);
+	
+	/* Wait for the consumer to release a block */
+	while(head - atomic_load_explicit(&r->tail, memory_order_acquire) >= (uint64_t) r->slots)
+	{
+		if(atomic_load_explicit(&r->closed, memory_order_acquire))
+		{
+			return(NULL);
+		}
+		
+		_ring_wait(r, _ring_writable, &spins);
+	}
+	
+	if(atomic_load_explicit(&r->closed, memory_order_acquire))
+	{
+		return(NULL);
+	}
+	
+	return(r->data + (head % r->slots) * r->size);
+}
+
+void ring_write_commit(struct ring_t *r)
+{
+	atomic_fetch_add(&r->head, 1);
+	_ring_wake(r);
+}
+
+void *ring_read_acquire(struct ring_t *r)
+{
+	uint64_t tail;
+	int spins = 0;
+	
+	tail = atomic_load_explicit(&r->tail, memory_order_relaxed);
+	
+	/* Wait for the producer to commit a block */
+	while(atomic_load_explicit(&r->head, memory_order_acquire) == tail)
+	{
+		if(atomic_load_explicit(&r->closed, memory_order_acquire))
+		{
+			/* Test again in case a block was committed before closing */
+			if(atomic_load_explicit(&r->head, memory_order_acquire) != tail) break;
+			return(NULL);
+		}
+		
+		_ring_wait(r, _ring_readable, &spins);
+	}
+	
+	return(r->data + (tail % r->slots) * r->size);
+}
+
+void ring_read_release(struct ring_t *r)
+{
+	atomic_fetch_add(&r->tail, 1);
+	_ring_wake(r);
+}
+
+void ring_close(struct ring_t *r)
+{
+	atomic_store(&r->closed, 1);
+	
+	/* Wake either side, whether or not it's asleep yet */
+	pthread_mutex_lock(&r->lock);
+	atomic_store(&r->waiting, 0);
+	pthread_cond_broadcast(&r->cond);
+	pthread_mutex_unlock(&r->lock);
+}
+
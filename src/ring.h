@@ -0,0 +1,70 @@
+/* satradio - Satellite radio sub-carrier modulator/encoder/transmitter  */
+/*=======================================================================*/
+/* Copyright 2022 Philip Heron <phil@sanslogic.co.uk>                    */
+/*                                                                       */
+/* This program is free software: you can redistribute it and/or modify  */
+/* it under the terms of the GNU General Public License as published by  */
+/* the Free Software Foundation, either version 3 of the License, or     */
+/* (at your option) any later version.                                   */
+/*                                                                       */
+/* This program is distributed in the hope that it will be useful,       */
+/* but WITHOUT ANY WARRANTY; without even the implied warranty of        */
+/* MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the         */
+/* GNU General Public License for more details.                          */
+/*                                                                       */
+/* You should have received a copy of the GNU General Public License     */
+/* along with this program.  If not, see <http://www.gnu.org/licenses/>. */
+
+#ifndef _RING_H
+#define _RING_H
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+#include <pthread.h>
+
+/* Single producer, single consumer ring of fixed size blocks. Passing
+ * blocks is lock-free. A side that has to wait spins briefly, then
+ * sleeps until the other side commits, releases or closes.
+ * 
+ * The producer calls ring_write_acquire() to get the next free block,
+ * fills it, then passes it to the consumer with ring_write_commit().
+ * The consumer calls ring_read_acquire() to get the next ready block
+ * and returns it to the producer with ring_read_release().
+ * 
+ * Either side may close the ring. Once closed, ring_write_acquire()
+ * returns NULL immediately and ring_read_acquire() returns NULL once
+ * all committed blocks have been read.
+*/
+
+struct ring_t {
+	
+	int slots;
+	size_t size;
+	uint8_t *data;
+	
+	/* Counters of blocks written and read. These are 64-bit so they
+	 * never wrap, the slot index of a 32-bit counter would jump at
+	 * 2^32 unless slots is a power of two */
+	atomic_uint_least64_t head;
+	atomic_uint_least64_t tail;
+	
+	atomic_int closed;
+	
+	/* Set while a side is asleep on cond */
+	atomic_int waiting;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	
+};
+
+extern int ring_init(struct ring_t *r, int slots, size_t size);
+extern void ring_free(struct ring_t *r);
+extern void *ring_write_acquire(struct ring_t *r);
+extern void ring_write_commit(struct ring_t *r);
+extern void *ring_read_acquire(struct ring_t *r);
+extern void ring_read_release(struct ring_t *r);
+extern void ring_close(struct ring_t *r);
+
+#endif
+
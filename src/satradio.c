@@ -1,14 +1,23 @@
-
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <getopt.h>
 #include <signal.h>
+#include <pthread.h>
+#include <time.h>
+#include <math.h>
+#include <inttypes.h>
+#include <limits.h>
 #include "conf.h"
 #include "src.h"
 #include "adr.h"
 #include "rf.h"
 #include "filter.h"
+#include "ring.h"
+#include "pool.h"
+#include "bus.h"
+#include "control.h"
+#include "cpu.h"
 
 enum satradio_channel_mode_t {
 	MODE_FM_MONO,
@@ -16,13 +25,123 @@ enum satradio_channel_mode_t {
 	MODE_ADR,
 };
 
+/* Quality levels a channel can be shed to when rendering falls behind */
+enum {
+	SHED_NONE,
+	SHED_REDUCED,
+	SHED_MUTED,
+};
+
+/* Symbols used by the QPSK filter of a reduced ADR channel */
+#define ADR_REDUCED_SPAN 3
+
+/* ADR symbols are shaped at ADR_OVERSAMPLE samples per symbol and
+ * linearly interpolated to the output rate, if that is at least twice
+ * the baseband rate. The images of the interpolator are over 60 dB
+ * down at this rate */
+#define ADR_OVERSAMPLE 32
+#define ADR_BASEBAND_RATE (ADR_SYMBOL_RATE * ADR_OVERSAMPLE)
+
+/* Below that, a filter at the output rate is used if it needs no more
+ * than ADR_MAX_PHASES phases. Otherwise the symbols are shaped at up
+ * to ADR_FARROW_OVERSAMPLE samples per symbol and interpolated with a
+ * cubic Farrow structure, its images over 60 dB down at 8 */
+#define ADR_MAX_PHASES 1024
+#define ADR_FARROW_OVERSAMPLE 8
+
+/* Shed a step when the smoothed render time is over SHED_HIGH of the
+ * block's duration, recovering a step after SHED_CALM seconds under
+ * SHED_LOW. No further change is made for SHED_HOLDOFF blocks */
+#define SHED_HIGH    0.9
+#define SHED_LOW     0.6
+#define SHED_CALM    2
+#define SHED_HOLDOFF 4
+
+/* FM audio is brought up from 32 kHz by FM_UPSAMPLE in two FIR stages,
+ * a x2 half-band and a x4 low pass, and then linearly interpolated to
+ * the output rate */
+#define FM_UPSAMPLE 8
+#define FM_FRAME    (ADR_SAMPLES_PER_FRAME * FM_UPSAMPLE)
+
+/* The fewest FM carriers worth rendering as a bank rather than alone */
+#define FM_BANK_MIN 4
+
+struct fm_range_t {
+	
+	/* Index of the audio segment, the interpolator and position
+	 * within the segment and the input totals at the start of
+	 * a range */
+	int h;
+	int interp;
+	int64_t pos;
+	int64_t sum[2];
+	
+};
+
+struct fm_lane_t {
+	
+	/* A carrier being modulated over a range, its place in the
+	 * audio, and the samples left of the range after the current
+	 * segment and of the segment itself */
+	struct satradio_channel_t *c;
+	int k;
+	const int16_t *held;
+	int interp;
+	int64_t pos;
+	int len;
+	int run;
+	
+};
+
+enum channel_change_op_t {
+	CHANGE_ADD,
+	CHANGE_REMOVE,
+	CHANGE_MUTE,
+	CHANGE_RETUNE,
+};
+
+struct channel_change_t {
+	
+	enum channel_change_op_t op;
+	int index;
+	
+	/* The channel to add, or the channel that was removed */
+	struct satradio_channel_t *c;
+	
+	int mute;
+	
+	/* The new modulators, which are swapped for the old ones */
+	struct rf_fm_t fm[2];
+	struct rf_mixer_t mixer;
+	double frequency[2];
+	
+	int result;
+	int done;
+	
+};
+
 struct satradio_channel_t {
 	
 	int index;
 	
+	/* Configuration, and the channel's section within it */
+	conf_t conf;
+	int section;
+	
 	int active;
+	int mute;
 	enum satradio_channel_mode_t mode;
 	
+	/* Carrier frequencies, deviation and level */
+	double frequency[2];
+	double deviation;
+	double level;
+	
+	/* Shedding priority and level, and the level used for this block */
+	int priority;
+	atomic_int shed;
+	int quality;
+	
 	/* Audio source */
 	struct src_t src;
 	unsigned int sample_rate;
@@ -31,21 +150,102 @@ struct satradio_channel_t {
 	
 	/* FM filters and modulator */
 	struct limiter_t limiter[2];
+	struct fir_int32_t up[2];
+	int32_t *upbuf;
 	struct rf_fm_t fm[2];
+	unsigned int fm_rate;
+	int64_t fm_step;
 	int interp;
 	
+	/* FM audio frame at fm_rate, the audio samples over the current
+	 * block led by the one before it, the state at the start of each
+	 * range, the input total and interpolator rounding error */
+	int16_t audio[FM_FRAME * 2];
+	int audio_pos;
+	int16_t *held[2];
+	int16_t prev[2];
+	struct fm_range_t *franges;
+	int64_t sum[2];
+	uint32_t err[2];
+	
 	/* ADR encoder and modulator */
-	struct adr_t adr;
+	struct adr_t *adr;
 	struct rf_qpsk_t qpsk;
 	struct rf_mixer_t mixer;
 	
-	/* Subcarrier pointers for modulator thread */
-	int16_t *subcarrier, *psubcarrier;
-	int16_t *subcarrier2, *psubcarrier2;
-	int subcarrier_len;
+	/* ADR symbols, sym0 being the index of the first in the buffer */
+	int16_t *isym, *qsym;
+	int64_t sym0, sym_end;
+	
+	/* The baseband rate over the output rate, as a ratio and a 32-bit
+	 * fraction. 1:1 when the symbols are shaped at the output rate.
+	 * The baseband is interpolated linearly, or cubic if set */
+	int64_t bb_num, bb_den;
+	int64_t bb_step;
+	int cubic;
+	
+	/* Position of the current block, the number of samples
+	 * rendered into it and if it is the last one */
+	int64_t sample;
+	int len;
+	int end;
+	
+	/* Working buffer for rendering a range */
+	int16_t *scratch;
+	
+	/* Channel thread and the ranges it has rendered */
+	struct satradio_t *s;
+	pthread_t thread;
+	struct ring_t ring;
+	int running;
+	
+	/* A retune waiting for the channel thread to apply it */
+	_Atomic(struct channel_change_t *) retune;
+};
+
+/* Channels are rendered in ranges of this many samples. Each range starts
+ * from a state calculated from its position in the stream, so they can be
+ * rendered in any order or in parallel. The range is also the tile each
+ * stage of the output works on, small enough that the channel sum,
+ * composite and modulator output stay in cache between stages */
+#define RANGE_SAMPLES 4096
+
+/* Scratch for rendering a range, the complex output followed by
+ * room for an ADR baseband of up to half the output rate */
+#define SCRATCH_SAMPLES (RANGE_SAMPLES + RANGE_SAMPLES / 2 + 4)
+
+struct range_task_t {
+	struct satradio_t *s;
+	int x;
+	struct bus_stats_t stats;
+	
+	/* Total of the composite in this range, then of all before it */
+	int64_t sum;
+};
+
+/* Number of ranges each channel thread may render ahead. Passing ranges
+ * rather than whole blocks keeps each ring small, 128 KB per channel,
+ * however long the blocks are */
+#define CHANNEL_RING_SLOTS 8
+
+/* Number of blocks buffered between each stage of the output pipeline */
+#define PIPELINE_SLOTS 3
+
+struct pipeline_block_t {
+	
+	/* When the block was started, for measuring latency */
+	double time;
+	
+	uint8_t data[];
 };
 
-#define MAX_CHANNELS 16
+struct channel_block_t {
+	
+	/* Set on the last range of the final block */
+	int end;
+	
+	int32_t samples[RANGE_SAMPLES];
+};
 
 struct satradio_t {
 	
@@ -53,14 +253,71 @@ struct satradio_t {
 	int verbose;
 	unsigned int sample_rate;
 	
-	/* Channels */
-	struct satradio_channel_t channels[MAX_CHANNELS];
+	/* Samples per output block, and the number of ranges in each */
+	int block_len;
+	int ranges;
 	
-	/* Modulator thread */
+	/* Render each channel on its own thread */
+	int threads;
+	
+	/* Worker pool, with a working buffer and
+	 * composite tile for each worker */
+	int workers;
+	struct pool_t pool;
+	int16_t **scratch;
+	int32_t **tiles;
+	struct range_task_t *tasks;
+	
+	/* Table of active channels */
+	struct satradio_channel_t **channels;
+	int nchannels;
+	int channels_len;
+	int next_index;
+	
+	/* Control socket, its permissions and what added channels may
+	 * open. A change is handed to the main loop and applied between
+	 * blocks. Changes to the table are made holding the lock */
+	struct control_t control;
+	int control_mode;
+	int control_input;
+	int control_exec;
+	pthread_mutex_t lock;
+	pthread_cond_t changed;
+	struct channel_change_t *change;
+	atomic_int pending;
+	int closing;
+	
+	/* Adaptive shedding. The smoothed render load, blocks spent under
+	 * the recovery threshold and blocks until the next change */
+	int shedding;
+	double load;
+	int calm;
+	int holdoff;
+	
+	/* The composite saturated to 16-bits, and the block being rendered */
+	struct ring_t composite;
+	int16_t *comp;
+	struct bus_stats_t stats;
+	
+	/* Modulator thread, with a tile of output to be converted. Each tile
+	 * seeks the modulator to its position and the composite total before
+	 * it, so the tiles of a block can be modulated in any order */
 	struct rf_fm_t fm;
+	int64_t fm_sample;
+	int64_t fm_sum;
+	int16_t *iq;
+	pthread_t fm_thread;
+	
+	/* Offline rendering of a file. The workers modulate the composite
+	 * as well, with no modulator thread, into the block being written */
+	int offline;
+	int16_t *offline_comp;
+	uint8_t *out;
 	
 	/* Output */
 	struct rf_t rf;
+	struct ring_t output;
+	pthread_t sink_thread;
 };
 
 volatile int _abort = 0;
@@ -77,19 +334,57 @@ static void _sigint_callback_handler(int signum)
 	_abort = 1;
 }
 
-static int _channel_src_open(struct satradio_t *s, int channel)
+static double _time(void)
+{
+	struct timespec ts;
+	
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	
+	return(ts.tv_sec + ts.tv_nsec * 1e-9);
+}
+
+static int64_t _composite_sum(const int16_t *comp, int len)
+{
+	int64_t sum = 0;
+	
+	while(len--)
+	{
+		sum += *(comp++);
+	}
+	
+	return(sum);
+}
+
+static void _modulate_tile(struct satradio_t *s, uint8_t *dst, const int16_t *comp, int64_t sample, int64_t sum, int len, int16_t *iq)
+{
+	struct rf_fm_t fm = s->fm;
+	
+	/* FM modulate a tile of the composite, converting to the
+	 * sink's format while it's in cache */
+	rf_fm_seek(&fm, sample, sum);
+	
+	if(s->rf.convert)
+	{
+		rf_fm_process(&fm, iq, comp, len);
+		rf_convert(&s->rf, dst, iq, len);
+	}
+	else
+	{
+		rf_fm_process(&fm, (int16_t *) dst, comp, len);
+	}
+}
+
+static int _channel_src_open(struct satradio_t *s, struct satradio_channel_t *ch)
 {
-	struct satradio_channel_t *ch;
+	int channel = ch->index;
 	const char *v;
 	int r;
 	
-	ch = &s->channels[channel];
-	
 	/* Open the audio source */
-	v = conf_str(s->conf, "channel", channel, "type", "rawaudio");
+	v = conf_str(ch->conf, "channel", ch->section, "type", "rawaudio");
 	if(strcmp(v, "rawaudio") == 0)
 	{
-		v = conf_str(s->conf, "channel", channel, "input", NULL);
+		v = conf_str(ch->conf, "channel", ch->section, "input", NULL);
 		if(!v)
 		{
 			fprintf(stderr, "Error: Missing input in channel %d.\n", channel + 1);
@@ -99,8 +394,8 @@ static int _channel_src_open(struct satradio_t *s, int channel)
 		r = src_rawaudio_open(
 			&ch->src,
 			v,
-			conf_bool(s->conf, "channel", channel, "exec", 0),
-			conf_bool(s->conf, "channel", channel, "stereo", 1)
+			conf_bool(ch->conf, "channel", ch->section, "exec", 0),
+			conf_bool(ch->conf, "channel", ch->section, "stereo", 1)
 		);
 		
 		if(r != 0)
@@ -114,8 +409,8 @@ static int _channel_src_open(struct satradio_t *s, int channel)
 		r = src_tone_open(
 			&ch->src,
 			ch->sample_rate,
-			conf_double(s->conf, "channel", channel, "tone_hz", 0),
-			conf_double(s->conf, "channel", channel, "tone_level", 0)
+			conf_double(ch->conf, "channel", ch->section, "tone_hz", 0),
+			conf_double(ch->conf, "channel", ch->section, "tone_level", 0)
 		);
 		
 		if(r != 0)
@@ -127,7 +422,7 @@ static int _channel_src_open(struct satradio_t *s, int channel)
 #ifdef HAVE_FFMPEG
 	else if(strcasecmp(v, "ffmpeg") == 0)
 	{
-		v = conf_str(s->conf, "channel", channel, "input", NULL);
+		v = conf_str(ch->conf, "channel", ch->section, "input", NULL);
 		if(!v)
 		{
 			fprintf(stderr, "Error: Missing input filename/URL for channel %d.\n", channel + 1);
@@ -159,7 +454,7 @@ static int _channel_src_read_mono(struct satradio_t *s, struct satradio_channel_
 	{
 		src_close(&ch->src);
 		
-		r = _channel_src_open(s, ch->index);
+		r = _channel_src_open(s, ch);
 		if(r != 0)
 		{
 			return(0);
@@ -177,7 +472,7 @@ static int _channel_src_read_stereo(struct satradio_t *s, struct satradio_channe
 	{
 		src_close(&ch->src);
 		
-		r = _channel_src_open(s, ch->index);
+		r = _channel_src_open(s, ch);
 		if(r != 0)
 		{
 			return(0);
@@ -187,324 +482,2390 @@ static int _channel_src_read_stereo(struct satradio_t *s, struct satradio_channe
 	return(src_read_stereo(&ch->src, dst_l, step_l, dst_r, step_r, samples));
 }
 
-static int _fm_mono_subcarrier(struct satradio_t *s, struct satradio_channel_t *c, int16_t *out, int bl)
+static int _fm_read_frame(struct satradio_t *s, struct satradio_channel_t *c)
 {
-	int16_t audio[ADR_SAMPLES_PER_FRAME];
-	int r;
+	int16_t audio[ADR_SAMPLES_PER_FRAME * 2];
+	int16_t *paudio = audio;
+	int32_t *up0 = c->upbuf;
+	int32_t *up1 = up0 + ADR_SAMPLES_PER_FRAME * 2;
+	int32_t *up2 = up1 + ADR_SAMPLES_PER_FRAME * 2 * 2;
+	int n = (c->mode == MODE_FM_DUAL ? 2 : 1);
+	int l = ADR_SAMPLES_PER_FRAME;
+	int r, i, k;
 	
-	while(bl > 0)
+	while(l > 0)
 	{
-		if(c->subcarrier_len == 0)
+		if(!c->repeat && src_eof(&c->src))
 		{
-			int l = ADR_SAMPLES_PER_FRAME;
-			int16_t *paudio;
-			
-			paudio = audio;
-			
-			while(l > 0)
-			{
-				if(!c->repeat && src_eof(&c->src))
-				{
-					return(-1);
-				}
-				
-				r = _channel_src_read_mono(s, c, paudio, 1, l);
-				if(r == 0)
-				{
-					break;
-				}
-				
-				paudio += r;
-				l -= r;
-			}
-			
-			limiter_process(&c->limiter[0], audio, audio, audio, ADR_SAMPLES_PER_FRAME, 1);
-			
-			/* Warning: Crude interpolation */
-			/* TODO: Do something better here */
-			c->subcarrier_len = 0;
-			c->psubcarrier = c->subcarrier;
-			
-			for(r = 0; r < ADR_SAMPLES_PER_FRAME; r++)
-			{
-				while(c->interp < s->sample_rate)
-				{
-					*(c->psubcarrier++) = audio[r];
-					c->subcarrier_len++;
-					c->interp += c->sample_rate;
-				}
-				
-				c->interp -= s->sample_rate;
-			}
-			
-			rf_fm_process(&c->fm[0], c->subcarrier, c->subcarrier, c->subcarrier_len);
-			c->psubcarrier = c->subcarrier;
+			return(-1);
+		}
+		
+		if(c->mode == MODE_FM_DUAL)
+		{
+			r = _channel_src_read_stereo(s, c, paudio, 2, paudio + 1, 2, l);
+			paudio += r * 2;
+		}
+		else
+		{
+			r = _channel_src_read_mono(s, c, paudio, 1, l);
+			paudio += r;
 		}
 		
-		while(bl > 0 && c->subcarrier_len > 0)
+		if(r == 0)
 		{
-			*(out++) += *(c->psubcarrier++);
-			c->subcarrier_len--;
-			bl--;
+			/* Pad out a short frame with silence */
+			memset(paudio, 0, sizeof(int16_t) * l * n);
+			break;
 		}
+		
+		l -= r;
 	}
 	
-	return(0);
-}
-
-static int _fm_dual_subcarrier(struct satradio_t *s, struct satradio_channel_t *c, int16_t *out, int bl)
-{
-	int16_t audio[ADR_SAMPLES_PER_FRAME * 2];
-	int r;
+	if(c->mode == MODE_FM_DUAL)
+	{
+		limiter_process(&c->limiter[0], audio, audio, audio, ADR_SAMPLES_PER_FRAME, 2);
+		limiter_process(&c->limiter[1], audio + 1, audio + 1, audio + 1, ADR_SAMPLES_PER_FRAME, 2);
+	}
+	else
+	{
+		limiter_process(&c->limiter[0], audio, audio, audio, ADR_SAMPLES_PER_FRAME, 1);
+	}
 	
-	while(bl > 0)
+	/* At reduced quality the audio is interpolated linearly up to
+	 * fm_rate from the last sample of the previous frame, skipping
+	 * the filters. Their images are left in, and the filters miss
+	 * this frame, so there's a short glitch on each change */
+	if(c->quality == SHED_REDUCED)
 	{
-		if(c->subcarrier_len == 0)
+		for(i = 0; i < FM_FRAME; i++)
 		{
-			int l = ADR_SAMPLES_PER_FRAME;
-			int16_t *paudio;
-			
-			paudio = audio;
-			
-			while(l > 0)
-			{
-				if(!c->repeat && src_eof(&c->src))
-				{
-					return(-1);
-				}
-				
-				r = _channel_src_read_stereo(s, c, paudio, 2, paudio + 1, 2, l);
-				if(r < 0)
-				{
-					return(-1);
-				}
-				
-				paudio += r * 2;
-				l -= r;
-			}
-			
-			limiter_process(&c->limiter[0], audio, audio, audio, ADR_SAMPLES_PER_FRAME, 2);
-			limiter_process(&c->limiter[1], audio + 1, audio + 1, audio + 1, ADR_SAMPLES_PER_FRAME, 2);
-			
-			/* Warning: Crude interpolation */
-			/* TODO: Do something better here */
-			c->subcarrier_len = 0;
-			c->psubcarrier = c->subcarrier;
-			c->psubcarrier2 = c->subcarrier2;
-			
-			for(r = 0; r < ADR_SAMPLES_PER_FRAME; r++)
+			for(k = 0; k < n; k++)
 			{
-				while(c->interp < s->sample_rate)
-				{
-					*(c->psubcarrier++) = audio[r * 2 + 0];
-					*(c->psubcarrier2++) = audio[r * 2 + 1];
-					c->subcarrier_len++;
-					c->interp += c->sample_rate;
-				}
-				
-				c->interp -= s->sample_rate;
+				r = (i < FM_UPSAMPLE ? c->audio[(FM_FRAME - 1) * n + k] : audio[(i / FM_UPSAMPLE - 1) * n + k]);
+				c->audio[i * n + k] = r + (audio[i / FM_UPSAMPLE * n + k] - r) * (i % FM_UPSAMPLE + 1) / FM_UPSAMPLE;
 			}
-			
-			rf_fm_process(&c->fm[0], c->subcarrier, c->subcarrier, c->subcarrier_len);
-			rf_fm_process(&c->fm[1], c->subcarrier2, c->subcarrier2, c->subcarrier_len);
-			c->psubcarrier = c->subcarrier;
-			c->psubcarrier2 = c->subcarrier2;
 		}
 		
-		while(bl > 0 && c->subcarrier_len > 0)
+		return(0);
+	}
+	
+	/* Upsample to fm_rate. The filters work on pairs of samples,
+	 * only the first of each is used for mono */
+	for(i = 0; i < ADR_SAMPLES_PER_FRAME; i++)
+	{
+		up0[i * 2 + 0] = audio[i * n];
+		up0[i * 2 + 1] = audio[i * n + n - 1];
+	}
+	
+	fir_int32_process(&c->up[0], up1, up0, ADR_SAMPLES_PER_FRAME);
+	fir_int32_process(&c->up[1], up2, up1, ADR_SAMPLES_PER_FRAME * 2);
+	
+	for(i = 0; i < FM_FRAME; i++)
+	{
+		for(k = 0; k < n; k++)
 		{
-			*(out++) += *(c->psubcarrier++) + *(c->psubcarrier2++);
-			c->subcarrier_len--;
-			bl--;
+			r = up2[i * 2 + k];
+			c->audio[i * n + k] = (r < INT16_MIN ? INT16_MIN : (r > INT16_MAX ? INT16_MAX : r));
 		}
 	}
 	
 	return(0);
 }
 
+static int _fm_run(struct satradio_t *s, struct satradio_channel_t *c, int interp)
+{
+	/* Returns the number of output samples left in the current
+	 * audio segment */
+	int l = (s->sample_rate - interp + c->fm_rate - 1) / c->fm_rate;
+	return(l > 1 ? l : 1);
+}
 
-static int _adr_subcarrier(struct satradio_t *s, struct satradio_channel_t *c, int16_t *out, int bl)
+static int64_t _fm_pos(struct satradio_t *s, int interp)
 {
-	int16_t audio[ADR_SAMPLES_PER_FRAME * 2];
-	uint8_t frame[ADR_FRAME_BYTES];
-	int r;
+	/* The position within an audio segment as a 32-bit fraction */
+	return(((int64_t) interp << 32) / s->sample_rate);
+}
+
+static int64_t _fm_sum(struct satradio_channel_t *c, int a, int b, int64_t w, int n, uint32_t *e)
+{
+	int64_t t;
+	
+	/* Returns the total of the first n samples interpolated from a
+	 * to b, starting at position w, and updates the rounding error
+	 * e. The samples are rounded with the error carried forward,
+	 * so their total is the unrounded total rounded down. This is
+	 * what the samples would total if each were generated */
+	t = (w * n + c->fm_step * ((int64_t) n * (n - 1) / 2)) * (b - a) + *e;
+	
+	*e = t & 0xFFFFFFFF;
+	
+	return((int64_t) a * n + (t >> 32));
+}
+
+static int _fm_prepare(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	struct fm_range_t *fr;
+	int n = (c->mode == MODE_FM_DUAL ? 2 : 1);
+	int64_t w;
+	uint32_t e;
+	int x, h, l, k, r;
+	
+	/* Only the audio samples are kept for the block, along with
+	 * the state at the start of each range to expand them from.
+	 * Segment h runs from held[h] to held[h + 1] */
+	for(k = 0; k < n; k++)
+	{
+		c->held[k][0] = c->prev[k];
+	}
 	
-	while(bl > 0)
+	for(x = h = r = 0; x < s->block_len; h++)
 	{
-		if(c->subcarrier_len == 0)
+		if(c->audio_pos == FM_FRAME)
 		{
-			int l = ADR_SAMPLES_PER_FRAME;
-			int16_t *paudio;
-			
-			paudio = audio;
-			
-			while(l > 0)
+			if(_fm_read_frame(s, c) != 0)
 			{
-				if(!c->repeat && src_eof(&c->src))
-				{
-					return(-1);
-				}
-				
-				if(c->stereo)
-				{
-					r = _channel_src_read_stereo(s, c, paudio, 2, paudio + 1, 2, l);
-					paudio += r * 2;
-				}
-				else
-				{
-					r = _channel_src_read_mono(s, c, paudio, 1, l);
-					paudio += r;
-				}
-				
-				if(r == 0)
-				{
-					break;
-				}
-				
-				l -= r;
+				break;
 			}
 			
-			if(c->stereo)
-			{
-				adr_feed(&c->adr, audio, 2, audio + 1, 2, ADR_SAMPLES_PER_FRAME);
-			}
-			else
-			{
-				adr_feed(&c->adr, audio, 1, NULL, 0, ADR_SAMPLES_PER_FRAME);
-			}
+			c->audio_pos = 0;
+		}
+		
+		for(k = 0; k < n; k++)
+		{
+			c->held[k][h + 1] = c->audio[c->audio_pos * n + k];
+		}
+		
+		/* The run of this segment, or what's left of it in this block */
+		l = _fm_run(s, c, c->interp);
+		if(l > s->block_len - x) l = s->block_len - x;
+		
+		/* Record the state at any range starting within the run */
+		w = _fm_pos(s, c->interp);
+		
+		for(; r * RANGE_SAMPLES < x + l; r++)
+		{
+			fr = &c->franges[r];
+			fr->h = h;
+			fr->interp = c->interp + (r * RANGE_SAMPLES - x) * c->fm_rate;
+			fr->pos = w + (r * RANGE_SAMPLES - x) * c->fm_step;
 			
-			while(adr_next_frame(&c->adr, frame) == 0)
+			for(k = 0; k < n; k++)
 			{
-				r = rf_qpsk_process(&c->qpsk, c->subcarrier, frame, ADR_FRAME_SYMS);
-				rf_mixer_process(&c->mixer, c->subcarrier, c->subcarrier, r);
-				
-				c->subcarrier_len = r;
-				c->psubcarrier = c->subcarrier;
+				e = c->err[k];
+				fr->sum[k] = c->sum[k] + _fm_sum(c, c->held[k][h], c->held[k][h + 1], w, r * RANGE_SAMPLES - x, &e);
 			}
 		}
 		
-		while(bl > 0 && c->subcarrier_len > 0)
+		for(k = 0; k < n; k++)
+		{
+			c->sum[k] += _fm_sum(c, c->held[k][h], c->held[k][h + 1], w, l, &c->err[k]);
+		}
+		
+		x += l;
+		c->interp += l * c->fm_rate;
+		if(c->interp >= s->sample_rate)
 		{
-			*(out++) += *(c->psubcarrier++);
-			c->subcarrier_len--;
-			bl--;
+			c->interp -= s->sample_rate;
+			c->audio_pos++;
+			
+			for(k = 0; k < n; k++)
+			{
+				c->prev[k] = c->held[k][h + 1];
+			}
 		}
 	}
 	
-	return(0);
+	return(x);
 }
 
-static void print_usage(void)
+static void _fm_lane_start(struct satradio_t *s, struct fm_lane_t *ln, struct satradio_channel_t *c, int k, int x, int len)
 {
-	printf(
-		"\n"
-		"Usage: satradio [options]\n"
-		"\n"
-		"  -c, --config <file>      Load configuration from file.\n"
-		"  -v, --verbose            Enable verbose output.\n"
-		"\n"
-	);
+	const struct fm_range_t *fr = &c->franges[x / RANGE_SAMPLES];
+	
+	ln->c = c;
+	ln->k = k;
+	ln->held = &c->held[k][fr->h];
+	ln->interp = fr->interp;
+	ln->pos = fr->pos;
+	ln->len = len;
+	ln->run = 0;
 }
 
-static int _modulate_channel(struct satradio_t *s, struct satradio_channel_t *c, int16_t *out, int bl)
+static void _fm_lane_next(struct satradio_t *s, struct fm_lane_t *ln, double *x, double *dx)
 {
-	int r;
+	struct satradio_channel_t *c = ln->c;
+	int d;
 	
-	if(!c->active)
-	{
-		return(-1);
-	}
+	/* Move on to the next audio segment. Each is a straight line
+	 * from held[0] to held[1], so its FM step rises by a fixed
+	 * amount each sample and the audio is never expanded. The
+	 * phase follows the unrounded line, within a fraction of a
+	 * unit of input total of _fm_sum() */
+	ln->run = _fm_run(s, c, ln->interp);
+	if(ln->run > ln->len) ln->run = ln->len;
 	
-	if(c->mode == MODE_FM_MONO)
-	{
-		r = _fm_mono_subcarrier(s, c, out, bl);
-	}
-	else if(c->mode == MODE_FM_DUAL)
-	{
-		r = _fm_dual_subcarrier(s, c, out, bl);
-	}
-	else if(c->mode == MODE_ADR)
+	d = ln->held[1] - ln->held[0];
+	*x = ln->held[0] + (double) (ln->pos * d) / 4294967296.0;
+	*dx = (double) (c->fm_step * d) / 4294967296.0;
+	
+	ln->len -= ln->run;
+	ln->interp += ln->run * c->fm_rate;
+	
+	if(ln->interp >= s->sample_rate)
 	{
-		r = _adr_subcarrier(s, c, out, bl);
+		ln->interp -= s->sample_rate;
+		ln->held++;
 	}
-	else
+	
+	ln->pos = _fm_pos(s, ln->interp);
+}
+
+static void _fm_render_lane(struct satradio_t *s, struct fm_lane_t *ln, int32_t *out, int x, int16_t *scratch)
+{
+	struct satradio_channel_t *c = ln->c;
+	struct rf_fm_t fm = c->fm[ln->k];
+	int16_t *dst;
+	double a, da;
+	int len = ln->len;
+	
+	/* Render a single carrier on its own, a segment at a time */
+	rf_fm_seek(&fm, c->sample + x, c->franges[x / RANGE_SAMPLES].sum[ln->k]);
+	
+	for(dst = scratch; ln->len > 0; dst += ln->run)
 	{
-		return(-1);
+		_fm_lane_next(s, ln, &a, &da);
+		rf_fm_ramp(&fm, dst, a, da, ln->run);
 	}
 	
-	if(r != 0)
+	bus_add_int16(out, scratch, len);
+}
+
+static void _fm_render(struct satradio_t *s, struct satradio_channel_t *c, int32_t *out, int x, int len, int16_t *scratch)
+{
+	struct fm_lane_t ln;
+	int k;
+	
+	for(k = 0; k < (c->mode == MODE_FM_DUAL ? 2 : 1); k++)
 	{
-		c->active = 0;
-		return(-1);
+		_fm_lane_start(s, &ln, c, k, x, len);
+		_fm_render_lane(s, &ln, out, x, scratch);
 	}
-	
-	return(0);
 }
 
-static int _main_loop(struct satradio_t *s)
+static void _fm_render_lanes(struct satradio_t *s, struct fm_lane_t *ln, int n, int32_t *out, int x)
 {
-	int16_t *sum;
-	int16_t *out;
-	int i, a, bl;
+	struct rf_fm_bank_t bank;
+	struct rf_fm_t fm;
+	double a, da;
+	int i, y, m, len;
 	
-	/* Allocate enough memory for 100ms sum and output buffers */
-	bl = s->sample_rate / 10;
-	sum = calloc(sizeof(int16_t), bl);
-	out = calloc(sizeof(int16_t) * 2, bl);
+	/* Render up to RF_FM_LANES carriers side by side, summed
+	 * straight onto out. The bank runs until the next lane
+	 * reaches the end of its segment, which is then reloaded */
+	rf_fm_bank_init(&bank);
 	
-	if(!sum || !out)
+	for(len = i = 0; i < n; i++)
 	{
-		free(sum);
-		free(out);
-		fprintf(stderr, "Out of memory.\n");
-		return(-1);
+		fm = ln[i].c->fm[ln[i].k];
+		rf_fm_seek(&fm, ln[i].c->sample + x, ln[i].c->franges[x / RANGE_SAMPLES].sum[ln[i].k]);
+		rf_fm_bank_set(&bank, i, &fm);
+		
+		if(ln[i].len > len) len = ln[i].len;
+		
+		_fm_lane_next(s, &ln[i], &a, &da);
+		rf_fm_bank_ramp(&bank, i, &fm, a, da);
 	}
 	
-	while(!_abort)
+	for(y = 0; y < len; y += m)
 	{
-		/* Poll each active channel and read 100ms of signal */
-		memset(sum, 0, bl * sizeof(int16_t));
+		m = len - y;
 		
-		for(a = i = 0; i < MAX_CHANNELS; i++)
+		for(i = 0; i < n; i++)
 		{
-			if(_modulate_channel(s, &s->channels[i], sum, bl) == 0) a++;
+			if(ln[i].run > 0 && ln[i].run < m) m = ln[i].run;
 		}
 		
-		/* End if there are no active stations */
-		if(a == 0) break;
+		rf_fm_bank_process(&bank, out + y, m);
 		
-		/* FM modulate the source */
-		rf_fm_process(&s->fm, out, sum, bl);
-		
-		/* Output to the radio */
-		rf_write(&s->rf, out, bl);
+		for(i = 0; i < n; i++)
+		{
+			if(ln[i].run == 0)
+			{
+				continue;
+			}
+			
+			ln[i].run -= m;
+			
+			if(ln[i].run > 0)
+			{
+				continue;
+			}
+			
+			if(ln[i].len > 0)
+			{
+				_fm_lane_next(s, &ln[i], &a, &da);
+				rf_fm_bank_ramp(&bank, i, &ln[i].c->fm[ln[i].k], a, da);
+			}
+			else
+			{
+				rf_fm_bank_set(&bank, i, NULL);
+			}
+		}
 	}
-	
-	free(sum);
-	free(out);
-	
-	return(0);
 }
 
-int main(int argc, char *argv[])
+static int64_t _adr_baseband(const struct satradio_channel_t *c, int64_t sample)
 {
-	struct satradio_t s;
-	const char *conffile = NULL;
-	int c, option_index;
-	const struct option long_options[] = {
-		{ "version", no_argument,       0, 'v' },
-		{ "config",  required_argument, 0, 'c' },
-		{ "verbose", no_argument,       0, 'V' },
-		{ 0, 0, 0, 0 }
-	};
-	int i, r;
-	const char *v;
+	/* The baseband sample at or before an output sample */
+	return(sample * c->bb_num / c->bb_den);
+}
+
+static int64_t _adr_samples(const struct satradio_channel_t *c, int64_t n)
+{
+	/* The number of output samples covered by n baseband samples. Each
+	 * interpolated sample needs the baseband sample after it too, and
+	 * another after that for the cubic */
+	if(c->bb_num == c->bb_den) return(n);
+	n -= 1 + c->cubic;
+	return(n < 1 ? 0 : (n * c->bb_den + c->bb_num - 1) / c->bb_num);
+}
+
+static int _adr_prepare(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	int16_t audio[ADR_SAMPLES_PER_FRAME * 2];
+	uint8_t frame[ADR_FRAME_BYTES];
+	int64_t m;
+	int r;
+	
+	/* Drop the symbols before the window of the first sample */
+	m = rf_qpsk_symbol(&c->qpsk, _adr_baseband(c, c->sample) - c->cubic) - (c->qpsk.ataps - 1);
+	if(m > c->sym0)
+	{
+		memmove(c->isym, c->isym + (m - c->sym0), sizeof(int16_t) * (c->sym_end - m));
+		memmove(c->qsym, c->qsym + (m - c->sym0), sizeof(int16_t) * (c->sym_end - m));
+		c->sym0 = m;
+	}
+	
+	/* Encode audio until there are symbols for the whole block */
+	m = _adr_baseband(c, c->sample + s->block_len - 1);
+	if(c->bb_num < c->bb_den) m += 1 + c->cubic;
+	m = rf_qpsk_symbol(&c->qpsk, m) + 1;
+	
+	while(c->sym_end < m)
+	{
+		int l = ADR_SAMPLES_PER_FRAME;
+		int16_t *paudio;
+		
+		paudio = audio;
+		
+		while(l > 0)
+		{
+			if(!c->repeat && src_eof(&c->src))
+			{
+				goto end;
+			}
+			
+			if(c->stereo)
+			{
+				r = _channel_src_read_stereo(s, c, paudio, 2, paudio + 1, 2, l);
+				paudio += r * 2;
+			}
+			else
+			{
+				r = _channel_src_read_mono(s, c, paudio, 1, l);
+				paudio += r;
+			}
+			
+			if(r == 0)
+			{
+				/* Pad out a short frame with silence */
+				memset(paudio, 0, sizeof(int16_t) * l * (c->stereo ? 2 : 1));
+				break;
+			}
+			
+			l -= r;
+		}
+		
+		if(c->stereo)
+		{
+			adr_feed(c->adr, audio, 2, audio + 1, 2, ADR_SAMPLES_PER_FRAME);
+		}
+		else
+		{
+			adr_feed(c->adr, audio, 1, NULL, 0, ADR_SAMPLES_PER_FRAME);
+		}
+		
+		while(adr_next_frame(c->adr, frame) == 0)
+		{
+			rf_qpsk_unpack(
+				c->isym + (c->sym_end - c->sym0),
+				c->qsym + (c->sym_end - c->sym0),
+				frame, ADR_FRAME_SYMS
+			);
+			
+			c->sym_end += ADR_FRAME_SYMS;
+		}
+	}
+	
+end:
+	/* Return the number of samples the symbols cover */
+	m = _adr_samples(c, rf_qpsk_samples(&c->qpsk, c->sym_end)) - c->sample;
+	
+	return(m < 0 ? 0 : (m > s->block_len ? s->block_len : m));
+}
+
+static void _adr_upsample(const struct satradio_channel_t *c, int16_t *dst, const int16_t *src, int64_t sample, int len)
+{
+	uint64_t p;
+	int64_t t;
+	int i, q, f, k;
+	
+	/* Interpolate the baseband from the sample at or before the
+	 * first output sample, src[0] (or src[1] for the cubic). The
+	 * position is a 32-bit fraction, exact at the start of each range */
+	p = (((uint64_t) (sample * c->bb_num % c->bb_den)) << 32) / c->bb_den;
+	
+	while(c->cubic && len--)
+	{
+		f = (p >> 17) & 0x7FFF;
+		
+		/* Cubic Lagrange through x[-1..2] in Farrow form, each
+		 * coefficient scaled by 6. 10923 / 2^16 is about 1/6 */
+		for(k = 0; k < 2; k++)
+		{
+			const int16_t *x = &src[(p >> 32) * 2 + k];
+			
+			t = x[6] - x[0] + 3 * (x[2] - x[4]);
+			t = ((t * f) >> 15) + 3 * (x[0] + x[4]) - 6 * x[2];
+			t = ((t * f) >> 15) + 6 * x[4] - 2 * x[0] - 3 * x[2] - x[6];
+			t = x[2] + ((t * f * 10923) >> 31);
+			
+			*(dst++) = t < INT16_MIN ? INT16_MIN : (t > INT16_MAX ? INT16_MAX : t);
+		}
+		
+		p += c->bb_step;
+	}
+	
+	while(!c->cubic && len--)
+	{
+		i = src[(p >> 32) * 2];
+		q = src[(p >> 32) * 2 + 1];
+		f = (p >> 17) & 0x7FFF;
+		
+		*(dst++) = i + (((src[(p >> 32) * 2 + 2] - i) * f) >> 15);
+		*(dst++) = q + (((src[(p >> 32) * 2 + 3] - q) * f) >> 15);
+		
+		p += c->bb_step;
+	}
+}
+
+static void _adr_render(struct satradio_t *s, struct satradio_channel_t *c, int32_t *out, int x, int len, int16_t *scratch)
+{
+	struct rf_mixer_t mixer;
+	unsigned int span;
+	int16_t *bb;
+	int64_t b;
+	int n, z;
+	
+	span = c->quality == SHED_REDUCED ? ADR_REDUCED_SPAN : c->qpsk.ataps;
+	
+	if(c->bb_num < c->bb_den)
+	{
+		bb = scratch + RANGE_SAMPLES * 2;
+		
+		/* Shape the baseband samples the range falls between. Any
+		 * before the start of the stream are silent */
+		b = _adr_baseband(c, c->sample + x) - c->cubic;
+		n = _adr_baseband(c, c->sample + x + len - 1) + 2 + c->cubic - b;
+		z = b < 0 ? -b : 0;
+		
+		memset(bb, 0, sizeof(int16_t) * 2 * z);
+		rf_qpsk_render(&c->qpsk, bb + z * 2, c->isym, c->qsym, c->sym0, b + z, n - z, span);
+		
+		_adr_upsample(c, scratch, bb, c->sample + x, len);
+	}
+	else
+	{
+		rf_qpsk_render(&c->qpsk, scratch, c->isym, c->qsym, c->sym0, c->sample + x, len, span);
+	}
+	
+	mixer = c->mixer;
+	rf_mixer_seek(&mixer, c->sample + x);
+	rf_mixer_process(&mixer, scratch, scratch, len);
+	
+	bus_add_int16(out, scratch, len);
+}
+
+static int _channel_alloc(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	int k, n;
+	
+	c->scratch = malloc(sizeof(int16_t) * 2 * SCRATCH_SAMPLES);
+	if(!c->scratch)
+	{
+		return(-1);
+	}
+	
+	if(c->mode == MODE_FM_MONO || c->mode == MODE_FM_DUAL)
+	{
+		double taps[111];
+		
+		c->audio_pos = FM_FRAME;
+		c->fm_rate = c->sample_rate * FM_UPSAMPLE;
+		c->fm_step = ((int64_t) c->fm_rate << 32) / s->sample_rate;
+		
+		/* A x2 half-band passing 15 kHz and rejecting its image at
+		 * 17 kHz, then a shorter x4 stage for the wider gap above */
+		fir_low_pass(taps, 111, c->sample_rate * 2, c->sample_rate / 2, 2);
+		if(c->mode == MODE_FM_DUAL) k = fir_int32_scomplex_init(&c->up[0], taps, 111, 2, 1, 0);
+		else k = fir_int32_init(&c->up[0], taps, 111, 2, 1, 0);
+		
+		fir_low_pass(taps, 31, c->fm_rate, c->sample_rate, 4);
+		if(c->mode == MODE_FM_DUAL) k |= fir_int32_scomplex_init(&c->up[1], taps, 31, 4, 1, 0);
+		else k |= fir_int32_init(&c->up[1], taps, 31, 4, 1, 0);
+		
+		c->upbuf = malloc(sizeof(int32_t) * ADR_SAMPLES_PER_FRAME * 2 * (1 + 2 + FM_UPSAMPLE));
+		if(k != 0 || !c->upbuf)
+		{
+			return(-1);
+		}
+		
+		/* Room for the audio samples over one block, which may be
+		 * partly covered at either end, and the one before it */
+		n = (int64_t) s->block_len * c->fm_rate / s->sample_rate + 4;
+		
+		for(k = 0; k < (c->mode == MODE_FM_DUAL ? 2 : 1); k++)
+		{
+			c->held[k] = malloc(sizeof(int16_t) * n);
+			if(!c->held[k])
+			{
+				return(-1);
+			}
+		}
+		
+		c->franges = calloc(s->ranges, sizeof(struct fm_range_t));
+		if(!c->franges)
+		{
+			return(-1);
+		}
+	}
+	else if(c->mode == MODE_ADR)
+	{
+		/* Room for one block of symbols, the window before it and
+		 * any overrun from the last frames encoded */
+		n = (int64_t) s->block_len * ADR_SYMBOL_RATE / s->sample_rate;
+		n += c->qpsk.ataps + ADR_FRAME_SYMS * 2 + 3;
+		
+		/* The window is empty before the first symbol */
+		c->isym = calloc(n, sizeof(int16_t));
+		c->qsym = calloc(n, sizeof(int16_t));
+		if(!c->isym || !c->qsym)
+		{
+			return(-1);
+		}
+		
+		c->sym0 = 1 - (int64_t) c->qpsk.ataps;
+		c->sym_end = 0;
+	}
+	
+	return(0);
+}
+
+static void _channel_free(struct satradio_channel_t *c)
+{
+	int k;
+	
+	src_close(&c->src);
+	
+	for(k = 0; k < 2; k++)
+	{
+		limiter_free(&c->limiter[k]);
+		fir_int32_free(&c->up[k]);
+		rf_fm_free(&c->fm[k]);
+		free(c->held[k]);
+	}
+	
+	if(c->adr)
+	{
+		adr_free(c->adr);
+		free(c->adr);
+	}
+	
+	rf_qpsk_free(&c->qpsk);
+	rf_mixer_free(&c->mixer);
+	
+	free(c->franges);
+	free(c->upbuf);
+	free(c->isym);
+	free(c->qsym);
+	free(c->scratch);
+	
+	/* Channels added at runtime have their own configuration */
+	if(c->conf != c->s->conf)
+	{
+		free(c->conf);
+	}
+	
+	free(c);
+}
+
+static int _channel_insert(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	struct satradio_channel_t **channels;
+	
+	/* Grow the table if it's full */
+	if(s->nchannels == s->channels_len)
+	{
+		channels = realloc(s->channels, sizeof(struct satradio_channel_t *) * (s->channels_len ? s->channels_len * 2 : 16));
+		if(!channels)
+		{
+			return(-1);
+		}
+		
+		s->channels = channels;
+		s->channels_len = s->channels_len ? s->channels_len * 2 : 16;
+	}
+	
+	s->channels[s->nchannels++] = c;
+	
+	return(0);
+}
+
+static struct satradio_channel_t *_channel_new(struct satradio_t *s, conf_t conf, int section)
+{
+	struct satradio_channel_t *c;
+	
+	c = calloc(1, sizeof(struct satradio_channel_t));
+	if(!c)
+	{
+		return(NULL);
+	}
+	
+	c->index = s->next_index++;
+	c->conf = conf;
+	c->section = section;
+	c->s = s;
+	
+	return(c);
+}
+
+static void _channel_reap(struct satradio_t *s)
+{
+	struct satradio_channel_t *c;
+	int i, n;
+	
+	/* Free any channels that have ended, keeping the table compact.
+	 * A running channel thread may still be updating active */
+	for(i = 0; i < s->nchannels; i++)
+	{
+		c = s->channels[i];
+		
+		if(!c->running && !c->active) break;
+	}
+	
+	if(i == s->nchannels)
+	{
+		return;
+	}
+	
+	pthread_mutex_lock(&s->lock);
+	
+	for(n = i; i < s->nchannels; i++)
+	{
+		c = s->channels[i];
+		
+		if(c->running || c->active)
+		{
+			s->channels[n++] = c;
+			continue;
+		}
+		
+		_channel_free(c);
+	}
+	
+	s->nchannels = n;
+	
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int _channel_init(struct satradio_t *s, struct satradio_channel_t *ch)
+{
+	const char *v;
+	int k, r;
+	
+	/* Configure the channel */
+	v = conf_str(ch->conf, "channel", ch->section, "mode", NULL);
+	if(v == NULL)
+	{
+		fprintf(stderr, "Error: No mode specified for channel %d.\n", ch->index + 1);
+		return(-1);
+	}
+	else if(strcmp(v, "fm") == 0)
+	{
+		const double *taps = NULL;
+		const double *sos = NULL;
+		int iir;
+		
+		ch->mode = MODE_FM_MONO;
+		
+		v = conf_str(ch->conf, "channel", ch->section, "preemphasis", "none");
+		if(strcmp(v, "none") == 0)
+		{
+			taps = preemph_flat_taps;
+			sos = preemph_flat_sos;
+		}
+		else if(strcmp(v, "50us") == 0)
+		{
+			taps = preemph_50us_taps;
+			sos = preemph_50us_sos;
+		}
+		else if(strcmp(v, "75us") == 0)
+		{
+			taps = preemph_75us_taps;
+			sos = preemph_75us_sos;
+		}
+		else if(strcmp(v, "j17") == 0)
+		{
+			taps = preemph_j17_taps;
+			sos = preemph_j17_sos;
+		}
+		else
+		{
+			fprintf(stderr, "Error: Unrecognised pre-emphasis mode '%s' for channel %d.\n", v, ch->index + 1);
+			return(-1);
+		}
+		
+		v = conf_str(ch->conf, "channel", ch->section, "preemphasis_filter", "fir");
+		if(strcmp(v, "fir") == 0) iir = 0;
+		else if(strcmp(v, "iir") == 0) iir = 1;
+		else
+		{
+			fprintf(stderr, "Error: Unrecognised pre-emphasis filter '%s' for channel %d.\n", v, ch->index + 1);
+			return(-1);
+		}
+		
+		ch->frequency[0] = conf_double(ch->conf, "channel", ch->section, "frequency", 0);
+		ch->deviation = conf_double(ch->conf, "channel", ch->section, "deviation", 50e3);
+		ch->level = conf_double(ch->conf, "channel", ch->section, "level", 1);
+		
+		r = rf_fm_init(&ch->fm[0],
+			s->sample_rate,
+			ch->frequency[0],
+			ch->deviation,
+			ch->level,
+			0 /* Real output */
+		);
+		
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: Failed to initalise FM modulator for channel %d.\n", ch->index + 1);
+			return(-1);
+		}
+		
+		if(iir) r = limiter_init_iir(&ch->limiter[0], INT16_MAX, 21, sos, preemph_flat_sos, PREEMPH_IIR_STAGES);
+		else r = limiter_init(&ch->limiter[0], INT16_MAX, 21, taps, preemph_flat_taps, PREEMPH_TAPS);
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: Unable to initalise pre-emphasis filter for channel %d.\n", ch->index + 1);
+			return(-1);
+		}
+		
+		ch->sample_rate = 32000;
+		ch->stereo = 0;
+	}
+	else if(strcmp(v, "dual-fm") == 0)
+	{
+		const double *taps = NULL;
+		const double *sos = NULL;
+		int iir;
+		
+		ch->mode = MODE_FM_DUAL;
+		
+		v = conf_str(ch->conf, "channel", ch->section, "preemphasis", "none");
+		if(strcmp(v, "none") == 0)
+		{
+			taps = preemph_flat_taps;
+			sos = preemph_flat_sos;
+		}
+		else if(strcmp(v, "50us") == 0)
+		{
+			taps = preemph_50us_taps;
+			sos = preemph_50us_sos;
+		}
+		else if(strcmp(v, "75us") == 0)
+		{
+			taps = preemph_75us_taps;
+			sos = preemph_75us_sos;
+		}
+		else if(strcmp(v, "j17") == 0)
+		{
+			taps = preemph_j17_taps;
+			sos = preemph_j17_sos;
+		}
+		else
+		{
+			fprintf(stderr, "Error: Unrecognised pre-emphasis mode '%s' for channel %d.\n", v, ch->index + 1);
+			return(-1);
+		}
+		
+		v = conf_str(ch->conf, "channel", ch->section, "preemphasis_filter", "fir");
+		if(strcmp(v, "fir") == 0) iir = 0;
+		else if(strcmp(v, "iir") == 0) iir = 1;
+		else
+		{
+			fprintf(stderr, "Error: Unrecognised pre-emphasis filter '%s' for channel %d.\n", v, ch->index + 1);
+			return(-1);
+		}
+		
+		ch->deviation = conf_double(ch->conf, "channel", ch->section, "deviation", 50e3);
+		ch->level = conf_double(ch->conf, "channel", ch->section, "level", 1);
+		
+		for(k = 0; k < 2; k++)
+		{
+			ch->frequency[k] = conf_double(ch->conf, "channel", ch->section, k == 0 ? "frequency1" : "frequency2", 0);
+			
+			r = rf_fm_init(&ch->fm[k],
+				s->sample_rate,
+				ch->frequency[k],
+				ch->deviation,
+				ch->level,
+				0 /* Real output */
+			);
+			
+			if(r != 0)
+			{
+				fprintf(stderr, "Error: Failed to initalise FM modulator for channel %d.\n", ch->index + 1);
+				return(-1);
+			}
+			
+			if(iir) r = limiter_init_iir(&ch->limiter[k], INT16_MAX, 21, sos, preemph_flat_sos, PREEMPH_IIR_STAGES);
+			else r = limiter_init(&ch->limiter[k], INT16_MAX, 21, taps, preemph_flat_taps, PREEMPH_TAPS);
+			if(r != 0)
+			{
+				fprintf(stderr, "Error: Unable to initalise pre-emphasis filter for channel %d.\n", ch->index + 1);
+				return(-1);
+			}
+		}
+		
+		ch->sample_rate = 32000;
+		ch->stereo = 1;
+	}
+	else if(strcmp(v, "adr") == 0)
+	{
+		TWOLAME_MPEG_mode mode;
+		
+		ch->mode = MODE_ADR;
+		
+		v = conf_str(ch->conf, "channel", ch->section, "adr_mode", "joint");
+		if(strcmp("mono", v) == 0) mode = TWOLAME_MONO;
+		else if(strcmp("dual", v) == 0) mode = TWOLAME_DUAL_CHANNEL;
+		else if(strcmp("joint", v) == 0) mode = TWOLAME_JOINT_STEREO;
+		else if(strcmp("stereo", v) == 0) mode = TWOLAME_STEREO;
+		else
+		{
+			fprintf(stderr, "Error: Unrecognised ADR mode '%s' for channel %d.\n", v, ch->index + 1);
+			return(-1);
+		}
+		
+		/* Initalise ADR encoder */
+		ch->adr = calloc(1, sizeof(struct adr_t));
+		if(!ch->adr)
+		{
+			fprintf(stderr, "Out of memory.\n");
+			return(-1);
+		}
+		
+		r = adr_init(ch->adr, mode, conf_bool(ch->conf, "channel", ch->section, "scfcrc", 1));
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: ADR encoder failed to initalise for channel %d.\n", ch->index + 1);
+			return(-1);
+		}
+		
+		/* Set the channel name */
+		adr_set_station_id(ch->adr, conf_str(ch->conf, "channel", ch->section, "name", ""));
+		
+		/* Initalise QPSK modulator and mixer */
+		r = rf_gcd(s->sample_rate, ADR_SYMBOL_RATE);
+		
+		if(s->sample_rate >= ADR_BASEBAND_RATE * 2)
+		{
+			k = ADR_OVERSAMPLE;
+			ch->cubic = 0;
+		}
+		else if(s->sample_rate / r > ADR_MAX_PHASES && s->sample_rate >= ADR_SYMBOL_RATE * 4)
+		{
+			/* The most samples per symbol at no more than half
+			 * the output rate */
+			for(k = ADR_FARROW_OVERSAMPLE; ADR_SYMBOL_RATE * k * 2 > s->sample_rate; k /= 2);
+			ch->cubic = 1;
+		}
+		else
+		{
+			k = 0;
+		}
+		
+		if(k > 0)
+		{
+			r = rf_gcd(s->sample_rate, ADR_SYMBOL_RATE * k);
+			
+			ch->bb_num = ADR_SYMBOL_RATE * k / r;
+			ch->bb_den = s->sample_rate / r;
+			ch->bb_step = ((int64_t) ADR_SYMBOL_RATE * k << 32) / s->sample_rate;
+			
+			r = rf_qpsk_init(&ch->qpsk, k, 1, 1);
+		}
+		else
+		{
+			ch->bb_num = ch->bb_den = 1;
+			
+			r = rf_qpsk_init(&ch->qpsk, s->sample_rate / r, ADR_SYMBOL_RATE / r, 1);
+		}
+		
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: Unable to initalise QPSK modulator for channel %d.\n", ch->index + 1);
+			return(-1);
+		}
+		
+		ch->frequency[0] = conf_double(ch->conf, "channel", ch->section, "frequency", 0);
+		ch->level = conf_double(ch->conf, "channel", ch->section, "level", 1);
+		
+		rf_mixer_init(&ch->mixer, s->sample_rate,
+			ch->frequency[0],
+			ch->level,
+			0 /* Real output */
+		);
+		
+		ch->sample_rate = ADR_SAMPLE_RATE;
+		ch->stereo = (mode == TWOLAME_MONO ? 0 : 1);
+	}
+	else
+	{
+		fprintf(stderr, "Error: Unsupported channel mode '%s' for channel %d.", v, ch->index + 1);
+		return(-1);
+	}
+	
+	/* Allocate the channel's buffers */
+	r = _channel_alloc(s, ch);
+	if(r != 0)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return(-1);
+	}
+	
+	/* Open the audio source */
+	ch->repeat = conf_bool(ch->conf, "channel", ch->section, "repeat", 0);
+	ch->priority = conf_int(ch->conf, "channel", ch->section, "priority", 0);
+	
+	r = _channel_src_open(s, ch);
+	if(r != 0)
+	{
+		return(-1);
+	}
+	
+	ch->active = 1;
+	
+	return(0);
+}
+
+static void print_usage(void)
+{
+	printf(
+		"\n"
+		"Usage: satradio [options]\n"
+		"\n"
+		"  -c, --config <file>      Load configuration from file.\n"
+		"  -v, --verbose            Enable verbose output.\n"
+		"\n"
+	);
+}
+
+static int _prepare_channel(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	/* Read and encode the input for the next block */
+	if(!c->active)
+	{
+		return(-1);
+	}
+	
+	/* The shedding level is fixed for the whole block */
+	c->quality = atomic_load(&c->shed);
+	
+	if(c->mode == MODE_FM_MONO || c->mode == MODE_FM_DUAL)
+	{
+		c->len = _fm_prepare(s, c);
+	}
+	else if(c->mode == MODE_ADR)
+	{
+		c->len = _adr_prepare(s, c);
+	}
+	else
+	{
+		c->len = 0;
+	}
+	
+	c->end = (c->len < s->block_len);
+	
+	return(0);
+}
+
+static void _render_range(struct satradio_t *s, struct satradio_channel_t *c, int32_t *out, int x, int16_t *scratch)
+{
+	int len;
+	
+	/* Add the range starting at sample x of the block to out,
+	 * which points to the start of the range */
+	len = c->len - x;
+	if(len > RANGE_SAMPLES) len = RANGE_SAMPLES;
+	if(len <= 0) return;
+	
+	if(c->mode == MODE_FM_MONO || c->mode == MODE_FM_DUAL)
+	{
+		_fm_render(s, c, out, x, len, scratch);
+	}
+	else if(c->mode == MODE_ADR)
+	{
+		_adr_render(s, c, out, x, len, scratch);
+	}
+}
+
+static int _finish_channel(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	c->sample += s->block_len;
+	
+	/* The final block is summed like any other, but the
+	 * channel no longer counts as active */
+	if(c->end)
+	{
+		c->active = 0;
+		return(-1);
+	}
+	
+	return(0);
+}
+
+static void _change_done(struct satradio_t *s, struct channel_change_t *ch, int result)
+{
+	/* Wake the control thread waiting on this change */
+	ch->result = result;
+	ch->done = 1;
+	pthread_cond_broadcast(&s->changed);
+}
+
+static void _retune_channel(struct satradio_channel_t *c, struct channel_change_t *ch)
+{
+	struct rf_fm_t fm;
+	struct rf_mixer_t mixer;
+	double f;
+	int k;
+	
+	/* Swap in the new modulators, handing back the old ones to be freed */
+	for(k = 0; k < 2; k++)
+	{
+		fm = c->fm[k];
+		c->fm[k] = ch->fm[k];
+		ch->fm[k] = fm;
+		
+		f = c->frequency[k];
+		c->frequency[k] = ch->frequency[k];
+		ch->frequency[k] = f;
+	}
+	
+	mixer = c->mixer;
+	c->mixer = ch->mixer;
+	ch->mixer = mixer;
+}
+
+static void *_channel_thread(void *arg)
+{
+	struct satradio_channel_t *c = arg;
+	struct satradio_t *s = c->s;
+	struct channel_change_t *ch;
+	struct channel_block_t *b;
+	int x, r, end = 0;
+	
+	while(!end)
+	{
+		/* Apply any retune before starting the block */
+		ch = atomic_exchange(&c->retune, NULL);
+		if(ch != NULL)
+		{
+			pthread_mutex_lock(&s->lock);
+			_retune_channel(c, ch);
+			_change_done(s, ch, 0);
+			pthread_mutex_unlock(&s->lock);
+		}
+		
+		r = _prepare_channel(s, c);
+		
+		/* Pass the block on a range at a time. A muted
+		 * channel is read as normal but not rendered */
+		for(x = 0; x < s->block_len; x += RANGE_SAMPLES)
+		{
+			b = ring_write_acquire(&c->ring);
+			if(b == NULL)
+			{
+				end = 1;
+				break;
+			}
+			
+			memset(b, 0, sizeof(struct channel_block_t));
+			
+			if(r == 0 && c->quality != SHED_MUTED)
+			{
+				_render_range(s, c, b->samples, x, c->scratch);
+			}
+			
+			if(x + RANGE_SAMPLES >= s->block_len)
+			{
+				end = (r != 0 || _finish_channel(s, c) != 0);
+				b->end = end;
+			}
+			
+			ring_write_commit(&c->ring);
+		}
+	}
+	
+	/* Signal the end of this channel */
+	ring_close(&c->ring);
+	
+	return(NULL);
+}
+
+static int _start_channel_thread(struct satradio_t *s, struct satradio_channel_t *c)
+{
+	int r;
+	
+	r = ring_init(&c->ring, CHANNEL_RING_SLOTS, sizeof(struct channel_block_t));
+	if(r != 0)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return(-1);
+	}
+	
+	r = pthread_create(&c->thread, NULL, &_channel_thread, c);
+	if(r != 0)
+	{
+		fprintf(stderr, "Error: Failed to start thread for channel %d.\n", c->index + 1);
+		ring_free(&c->ring);
+		return(-1);
+	}
+	
+	c->running = 1;
+	
+	return(0);
+}
+
+static int _start_channel_threads(struct satradio_t *s)
+{
+	int i;
+	
+	for(i = 0; i < s->nchannels; i++)
+	{
+		if(s->channels[i]->active && _start_channel_thread(s, s->channels[i]) != 0)
+		{
+			return(-1);
+		}
+	}
+	
+	return(0);
+}
+
+static void _stop_channel_thread(struct satradio_channel_t *c)
+{
+	struct channel_change_t *ch;
+	
+	if(!c->running)
+	{
+		return;
+	}
+	
+	/* Release the thread if it's waiting on a free block */
+	ring_close(&c->ring);
+	pthread_join(c->thread, NULL);
+	ring_free(&c->ring);
+	
+	c->running = 0;
+	c->active = 0;
+	
+	/* Fail any retune the thread didn't get to */
+	ch = atomic_exchange(&c->retune, NULL);
+	if(ch != NULL)
+	{
+		pthread_mutex_lock(&c->s->lock);
+		_change_done(c->s, ch, -1);
+		pthread_mutex_unlock(&c->s->lock);
+	}
+}
+
+static int _sum_channels(struct satradio_t *s, int16_t *comp)
+{
+	struct satradio_channel_t *c;
+	const struct channel_block_t *b;
+	int32_t *tile = s->tiles[0];
+	int i, x, len, a, end;
+	
+	/* Sum and saturate the next range from each channel thread */
+	for(x = 0; x < s->block_len; x += RANGE_SAMPLES)
+	{
+		len = s->block_len - x;
+		if(len > RANGE_SAMPLES) len = RANGE_SAMPLES;
+		
+		memset(tile, 0, sizeof(int32_t) * len);
+		
+		for(i = 0; i < s->nchannels; i++)
+		{
+			c = s->channels[i];
+			
+			if(!c->running)
+			{
+				continue;
+			}
+			
+			b = ring_read_acquire(&c->ring);
+			if(b == NULL)
+			{
+				_stop_channel_thread(c);
+				continue;
+			}
+			
+			if(!c->mute)
+			{
+				bus_add_int32(tile, b->samples, len);
+			}
+			
+			end = b->end;
+			ring_read_release(&c->ring);
+			
+			/* The final range is summed like any other,
+			 * but the channel no longer counts as active */
+			if(end)
+			{
+				_stop_channel_thread(c);
+			}
+		}
+		
+		bus_saturate(comp + x, tile, len, &s->stats);
+	}
+	
+	for(a = i = 0; i < s->nchannels; i++)
+	{
+		if(s->channels[i]->running) a++;
+	}
+	
+	return(a);
+}
+
+static void _prepare_task(void *arg, int worker)
+{
+	struct satradio_channel_t *c = arg;
+	
+	_prepare_channel(c->s, c);
+}
+
+static void _range_task(void *arg, int worker)
+{
+	struct range_task_t *t = arg;
+	struct satradio_t *s = t->s;
+	struct satradio_channel_t *c;
+	struct fm_lane_t ln[RF_FM_LANES];
+	int32_t *tile = s->tiles[worker];
+	int i, k, n, l, len;
+	
+	len = s->block_len - t->x;
+	if(len > RANGE_SAMPLES) len = RANGE_SAMPLES;
+	
+	memset(tile, 0, sizeof(int32_t) * len);
+	
+	/* Render every prepared channel's part of this range, then
+	 * saturate it onto the composite while it's still in cache.
+	 * FM carriers are gathered up and rendered a bank at a time */
+	for(n = i = 0; i < s->nchannels; i++)
+	{
+		c = s->channels[i];
+		
+		if(!c->active || c->mute || c->quality == SHED_MUTED)
+		{
+			continue;
+		}
+		
+		if(c->mode != MODE_FM_MONO && c->mode != MODE_FM_DUAL)
+		{
+			_render_range(s, c, tile, t->x, s->scratch[worker]);
+			continue;
+		}
+		
+		l = c->len - t->x;
+		if(l > RANGE_SAMPLES) l = RANGE_SAMPLES;
+		
+		for(k = 0; l > 0 && k < (c->mode == MODE_FM_DUAL ? 2 : 1); k++)
+		{
+			_fm_lane_start(s, &ln[n++], c, k, t->x, l);
+			
+			if(n == RF_FM_LANES)
+			{
+				_fm_render_lanes(s, ln, n, tile, t->x);
+				n = 0;
+			}
+		}
+	}
+	
+	/* A bank costs the same however few lanes are in use */
+	if(n >= FM_BANK_MIN)
+	{
+		_fm_render_lanes(s, ln, n, tile, t->x);
+	}
+	else
+	{
+		for(k = 0; k < n; k++)
+		{
+			_fm_render_lane(s, &ln[k], tile, t->x, s->scratch[worker]);
+		}
+	}
+	
+	bus_saturate(s->comp + t->x, tile, len, &t->stats);
+	t->sum = _composite_sum(s->comp + t->x, len);
+}
+
+static void _modulate_task(void *arg, int worker)
+{
+	struct range_task_t *t = arg;
+	struct satradio_t *s = t->s;
+	int len;
+	
+	len = s->block_len - t->x;
+	if(len > RANGE_SAMPLES) len = RANGE_SAMPLES;
+	
+	_modulate_tile(s,
+		s->out + t->x * rf_sample_size(&s->rf),
+		s->comp + t->x,
+		s->fm_sample + t->x,
+		t->sum, len,
+		s->scratch[worker]
+	);
+}
+
+static int _start_render(struct satradio_t *s)
+{
+	int i, r;
+	
+	if(s->workers > 0)
+	{
+		r = pool_init(&s->pool, s->workers);
+		if(r != 0)
+		{
+			fprintf(stderr, "Error: Failed to start the worker pool.\n");
+			return(-1);
+		}
+	}
+	
+	/* Each worker has its own working buffers, and
+	 * the thread waiting on the pool also runs tasks */
+	s->scratch = calloc(s->workers + 1, sizeof(int16_t *));
+	s->tiles = calloc(s->workers + 1, sizeof(int32_t *));
+	s->tasks = calloc(s->ranges, sizeof(struct range_task_t));
+	if(!s->scratch || !s->tiles || !s->tasks)
+	{
+		fprintf(stderr, "Out of memory.\n");
+		return(-1);
+	}
+	
+	for(i = 0; i <= s->workers; i++)
+	{
+		s->scratch[i] = malloc(sizeof(int16_t) * 2 * SCRATCH_SAMPLES);
+		s->tiles[i] = malloc(sizeof(int32_t) * RANGE_SAMPLES);
+		if(!s->scratch[i] || !s->tiles[i])
+		{
+			fprintf(stderr, "Out of memory.\n");
+			return(-1);
+		}
+	}
+	
+	for(i = 0; i < s->ranges; i++)
+	{
+		s->tasks[i].s = s;
+		s->tasks[i].x = i * RANGE_SAMPLES;
+	}
+	
+	return(0);
+}
+
+static void _stop_render(struct satradio_t *s)
+{
+	int i;
+	
+	if(s->pool.workers > 0)
+	{
+		pool_free(&s->pool);
+	}
+	
+	for(i = 0; i <= s->workers; i++)
+	{
+		if(s->scratch) free(s->scratch[i]);
+		if(s->tiles) free(s->tiles[i]);
+	}
+	
+	free(s->scratch);
+	free(s->tiles);
+	free(s->tasks);
+	
+	s->scratch = NULL;
+	s->tiles = NULL;
+	s->tasks = NULL;
+}
+
+static int _render_channels(struct satradio_t *s, int16_t *comp)
+{
+	struct satradio_channel_t *c;
+	struct bus_stats_t *stats;
+	int i, a;
+	
+	/* Read and encode the next block for each active channel */
+	for(i = 0; i < s->nchannels; i++)
+	{
+		c = s->channels[i];
+		
+		if(!c->active)
+		{
+			continue;
+		}
+		
+		if(s->workers == 0 || pool_submit(&s->pool, _prepare_task, c) != 0)
+		{
+			_prepare_task(c, s->workers);
+		}
+	}
+	
+	if(s->workers > 0)
+	{
+		pool_wait(&s->pool);
+	}
+	
+	/* Render the composite a range at a time, each task
+	 * adding every channel in turn */
+	s->comp = comp;
+	
+	for(i = 0; i < s->ranges; i++)
+	{
+		memset(&s->tasks[i].stats, 0, sizeof(struct bus_stats_t));
+		
+		if(s->workers == 0 || pool_submit(&s->pool, _range_task, &s->tasks[i]) != 0)
+		{
+			_range_task(&s->tasks[i], s->workers);
+		}
+	}
+	
+	if(s->workers > 0)
+	{
+		pool_wait(&s->pool);
+	}
+	
+	for(i = 0; i < s->ranges; i++)
+	{
+		stats = &s->tasks[i].stats;
+		
+		if(stats->peak > s->stats.peak) s->stats.peak = stats->peak;
+		s->stats.clipped += stats->clipped;
+	}
+	
+	for(a = i = 0; i < s->nchannels; i++)
+	{
+		c = s->channels[i];
+		
+		if(c->active && _finish_channel(s, c) == 0) a++;
+	}
+	
+	return(a);
+}
+
+static void _modulate_block(struct satradio_t *s, int16_t *comp, uint8_t *out)
+{
+	int64_t sum;
+	int i;
+	
+	/* Each range starts from the composite total before it, which
+	 * is all the modulator needs to pick up the phase at a seam */
+	for(i = 0; i < s->ranges; i++)
+	{
+		sum = s->tasks[i].sum;
+		s->tasks[i].sum = s->fm_sum;
+		s->fm_sum += sum;
+	}
+	
+	s->comp = comp;
+	s->out = out;
+	
+	for(i = 0; i < s->ranges; i++)
+	{
+		if(s->workers == 0 || pool_submit(&s->pool, _modulate_task, &s->tasks[i]) != 0)
+		{
+			_modulate_task(&s->tasks[i], s->workers);
+		}
+	}
+	
+	if(s->workers > 0)
+	{
+		pool_wait(&s->pool);
+	}
+	
+	s->fm_sample += s->block_len;
+}
+
+static void _apply_change(struct satradio_t *s)
+{
+	struct channel_change_t *ch;
+	struct satradio_channel_t *c = NULL;
+	int i, r = 0;
+	
+	/* Called by the main loop between blocks */
+	pthread_mutex_lock(&s->lock);
+	
+	ch = s->change;
+	s->change = NULL;
+	atomic_store(&s->pending, 0);
+	
+	if(ch == NULL)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	
+	for(i = 0; i < s->nchannels; i++)
+	{
+		if(s->channels[i]->index == ch->index)
+		{
+			c = s->channels[i];
+			break;
+		}
+	}
+	
+	if(ch->op != CHANGE_ADD && c == NULL)
+	{
+		_change_done(s, ch, -1);
+		pthread_mutex_unlock(&s->lock);
+		return;
+	}
+	
+	switch(ch->op)
+	{
+	case CHANGE_ADD:
+		
+		r = _channel_insert(s, ch->c);
+		
+		if(r == 0 && s->threads && _start_channel_thread(s, ch->c) != 0)
+		{
+			s->nchannels--;
+			r = -1;
+		}
+		
+		break;
+		
+	case CHANGE_REMOVE:
+		
+		/* The control thread stops and frees the channel */
+		memmove(&s->channels[i], &s->channels[i + 1], sizeof(struct satradio_channel_t *) * (s->nchannels - i - 1));
+		s->nchannels--;
+		ch->c = c;
+		
+		break;
+		
+	case CHANGE_MUTE:
+		
+		c->mute = ch->mute;
+		
+		break;
+		
+	case CHANGE_RETUNE:
+		
+		if(c->running)
+		{
+			/* The channel thread applies this before its next block */
+			atomic_store(&c->retune, ch);
+			pthread_mutex_unlock(&s->lock);
+			return;
+		}
+		
+		_retune_channel(c, ch);
+		
+		break;
+	}
+	
+	_change_done(s, ch, r);
+	
+	pthread_mutex_unlock(&s->lock);
+}
+
+static int _post_change(struct satradio_t *s, struct channel_change_t *ch)
+{
+	/* Hand a change to the main loop and wait for it to be applied */
+	pthread_mutex_lock(&s->lock);
+	
+	if(s->closing)
+	{
+		pthread_mutex_unlock(&s->lock);
+		return(-1);
+	}
+	
+	ch->done = 0;
+	s->change = ch;
+	atomic_store(&s->pending, 1);
+	
+	while(!ch->done)
+	{
+		pthread_cond_wait(&s->changed, &s->lock);
+	}
+	
+	pthread_mutex_unlock(&s->lock);
+	
+	return(ch->result);
+}
+
+static void _close_changes(struct satradio_t *s)
+{
+	/* Fail any waiting change, and any posted after this */
+	pthread_mutex_lock(&s->lock);
+	
+	s->closing = 1;
+	
+	if(s->change != NULL)
+	{
+		_change_done(s, s->change, -1);
+		s->change = NULL;
+	}
+	
+	pthread_mutex_unlock(&s->lock);
+}
+
+static void _control_add(struct satradio_t *s, char *args, FILE *reply)
+{
+	struct channel_change_t ch;
+	struct satradio_channel_t *c;
+	conf_t conf;
+	char *text, *d;
+	int q;
+	
+	/* Build a channel section from the key=value arguments */
+	text = malloc(strlen(args) * 2 + 16);
+	if(!text)
+	{
+		fprintf(reply, "ERROR Out of memory\n");
+		return;
+	}
+	
+	d = text + sprintf(text, "[channel]\n");
+	
+	while(*args)
+	{
+		if(*args == ' ' || *args == '\t')
+		{
+			args++;
+			continue;
+		}
+		
+		for(q = 0; *args && (q || (*args != ' ' && *args != '\t')); args++)
+		{
+			if(*args == '"') q = !q;
+			else if(q && *args == '\\' && args[1]) *(d++) = *(args++);
+			
+			*(d++) = *args;
+		}
+		
+		*(d++) = '\n';
+	}
+	
+	*d = '\0';
+	
+	conf = conf_loadstr("control", text);
+	free(text);
+	
+	if(!conf)
+	{
+		fprintf(reply, "ERROR Out of memory\n");
+		return;
+	}
+	
+	/* Reading files and running commands is off unless enabled */
+	if(!s->control_exec && conf_bool(conf, "channel", 0, "exec", 0))
+	{
+		free(conf);
+		fprintf(reply, "ERROR exec is not enabled (control_exec)\n");
+		return;
+	}
+	
+	if(!s->control_input && conf_key_exists(conf, "channel", 0, "input"))
+	{
+		free(conf);
+		fprintf(reply, "ERROR input is not enabled (control_input)\n");
+		return;
+	}
+	
+	c = _channel_new(s, conf, 0);
+	if(!c)
+	{
+		free(conf);
+		fprintf(reply, "ERROR Out of memory\n");
+		return;
+	}
+	
+	/* Set up the channel here, away from the main loop */
+	if(_channel_init(s, c) != 0)
+	{
+		_channel_free(c);
+		fprintf(reply, "ERROR Failed to initialise channel\n");
+		return;
+	}
+	
+	memset(&ch, 0, sizeof(struct channel_change_t));
+	ch.op = CHANGE_ADD;
+	ch.index = c->index;
+	ch.c = c;
+	
+	if(_post_change(s, &ch) != 0)
+	{
+		_channel_free(c);
+		fprintf(reply, "ERROR Failed to add channel\n");
+		return;
+	}
+	
+	fprintf(reply, "OK %d\n", ch.index + 1);
+}
+
+static void _control_remove(struct satradio_t *s, int index, FILE *reply)
+{
+	struct channel_change_t ch;
+	
+	memset(&ch, 0, sizeof(struct channel_change_t));
+	ch.op = CHANGE_REMOVE;
+	ch.index = index;
+	
+	if(_post_change(s, &ch) != 0)
+	{
+		fprintf(reply, "ERROR No such channel\n");
+		return;
+	}
+	
+	/* The channel is no longer in the table */
+	_stop_channel_thread(ch.c);
+	_channel_free(ch.c);
+	
+	fprintf(reply, "OK\n");
+}
+
+static void _control_mute(struct satradio_t *s, int index, int mute, FILE *reply)
+{
+	struct channel_change_t ch;
+	
+	memset(&ch, 0, sizeof(struct channel_change_t));
+	ch.op = CHANGE_MUTE;
+	ch.index = index;
+	ch.mute = mute;
+	
+	if(_post_change(s, &ch) != 0)
+	{
+		fprintf(reply, "ERROR No such channel\n");
+		return;
+	}
+	
+	fprintf(reply, "OK\n");
+}
+
+static void _control_retune(struct satradio_t *s, int index, char *args, FILE *reply)
+{
+	struct channel_change_t ch;
+	enum satradio_channel_mode_t mode = MODE_FM_MONO;
+	double deviation = 0, level = 0;
+	char *e;
+	int i, k, n, r, found = 0;
+	
+	memset(&ch, 0, sizeof(struct channel_change_t));
+	ch.op = CHANGE_RETUNE;
+	ch.index = index;
+	
+	/* Look up the channel's mode and levels. The table may change
+	 * as soon as the lock is released */
+	pthread_mutex_lock(&s->lock);
+	
+	for(i = 0; i < s->nchannels && s->channels[i]->index != index; i++);
+	
+	if(i < s->nchannels)
+	{
+		mode = s->channels[i]->mode;
+		deviation = s->channels[i]->deviation;
+		level = s->channels[i]->level;
+		found = 1;
+	}
+	
+	pthread_mutex_unlock(&s->lock);
+	
+	if(!found)
+	{
+		fprintf(reply, "ERROR No such channel\n");
+		return;
+	}
+	
+	n = (mode == MODE_FM_DUAL ? 2 : 1);
+	
+	for(k = 0; k < n; k++)
+	{
+		ch.frequency[k] = strtod(args, &e);
+		if(e == args) break;
+		args = e;
+	}
+	
+	if(k < n || args[strspn(args, " \t")] != '\0')
+	{
+		fprintf(reply, "ERROR Expected %d frequenc%s\n", n, n == 1 ? "y" : "ies");
+		return;
+	}
+	
+	/* Only this channel's tables are rebuilt */
+	for(r = k = 0; k < n && r == 0; k++)
+	{
+		if(mode == MODE_ADR)
+		{
+			r = rf_mixer_init(&ch.mixer, s->sample_rate, ch.frequency[k], level, 0);
+		}
+		else
+		{
+			r = rf_fm_init(&ch.fm[k], s->sample_rate, ch.frequency[k], deviation, level, 0);
+		}
+	}
+	
+	if(r == 0 && _post_change(s, &ch) == 0)
+	{
+		fprintf(reply, "OK\n");
+	}
+	else
+	{
+		fprintf(reply, "ERROR Failed to retune channel\n");
+	}
+	
+	/* These are now either the old modulators or the unused new ones */
+	for(k = 0; k < 2; k++)
+	{
+		rf_fm_free(&ch.fm[k]);
+	}
+	
+	rf_mixer_free(&ch.mixer);
+}
+
+static void _control_list(struct satradio_t *s, FILE *reply)
+{
+	static const char *modes[] = { "fm", "dual-fm", "adr" };
+	struct {
+		int index;
+		enum satradio_channel_mode_t mode;
+		double frequency[2];
+		int mute;
+	} *list;
+	int i, n;
+	
+	/* Copy the table so the lock isn't held while replying */
+	pthread_mutex_lock(&s->lock);
+	
+	n = s->nchannels;
+	list = malloc(sizeof(*list) * (n > 0 ? n : 1));
+	
+	for(i = 0; list && i < n; i++)
+	{
+		list[i].index = s->channels[i]->index;
+		list[i].mode = s->channels[i]->mode;
+		list[i].frequency[0] = s->channels[i]->frequency[0];
+		list[i].frequency[1] = s->channels[i]->frequency[1];
+		list[i].mute = s->channels[i]->mute;
+	}
+	
+	pthread_mutex_unlock(&s->lock);
+	
+	if(!list)
+	{
+		fprintf(reply, "ERROR Out of memory\n");
+		return;
+	}
+	
+	for(i = 0; i < n; i++)
+	{
+		fprintf(reply, "%d %s %.0f", list[i].index + 1, modes[list[i].mode], list[i].frequency[0]);
+		if(list[i].mode == MODE_FM_DUAL) fprintf(reply, " %.0f", list[i].frequency[1]);
+		fprintf(reply, "%s\n", list[i].mute ? " muted" : "");
+	}
+	
+	free(list);
+	
+	fprintf(reply, "OK\n");
+}
+
+static void _control(void *arg, char *line, FILE *reply)
+{
+	struct satradio_t *s = arg;
+	char *cmd, *args, *e;
+	int index = -1;
+	
+	/* Commands are a word followed by any arguments */
+	cmd = line + strspn(line, " \t");
+	args = cmd + strcspn(cmd, " \t");
+	if(*args) *(args++) = '\0';
+	
+	if(*cmd == '\0')
+	{
+		return;
+	}
+	
+	if(strcmp(cmd, "add") != 0 && strcmp(cmd, "list") != 0 &&
+	   strcmp(cmd, "remove") != 0 && strcmp(cmd, "retune") != 0 &&
+	   strcmp(cmd, "mute") != 0 && strcmp(cmd, "unmute") != 0)
+	{
+		fprintf(reply, "ERROR Unrecognised command '%s'\n", cmd);
+		return;
+	}
+	
+	/* The other commands take a channel number first */
+	if(strcmp(cmd, "add") != 0 && strcmp(cmd, "list") != 0)
+	{
+		index = strtol(args, &e, 10) - 1;
+		if(e == args || index < 0)
+		{
+			fprintf(reply, "ERROR Expected a channel number\n");
+			return;
+		}
+		
+		args = e;
+	}
+	
+	if(strcmp(cmd, "add") == 0)
+	{
+		_control_add(s, args, reply);
+	}
+	else if(strcmp(cmd, "remove") == 0)
+	{
+		_control_remove(s, index, reply);
+	}
+	else if(strcmp(cmd, "mute") == 0 || strcmp(cmd, "unmute") == 0)
+	{
+		_control_mute(s, index, strcmp(cmd, "mute") == 0, reply);
+	}
+	else if(strcmp(cmd, "retune") == 0)
+	{
+		_control_retune(s, index, args, reply);
+	}
+	else if(strcmp(cmd, "list") == 0)
+	{
+		_control_list(s, reply);
+	}
+}
+
+static int _shed_reduces(const struct satradio_channel_t *c)
+{
+	/* Returns 1 if the channel has a cheaper reduced quality. FM
+	 * skips its upsampling filters. An ADR channel with a pattern
+	 * table always uses the whole filter */
+	if(c->mode == MODE_ADR)
+	{
+		return(c->qpsk.lut == NULL);
+	}
+	
+	return(1);
+}
+
+static void _shed(struct satradio_t *s)
+{
+	struct satradio_channel_t *c, *best = NULL;
+	int i, top, bottom, level;
+	
+	for(top = INT_MIN, bottom = INT_MAX, i = 0; i < s->nchannels; i++)
+	{
+		if(s->channels[i]->priority > top) top = s->channels[i]->priority;
+		if(s->channels[i]->priority < bottom) bottom = s->channels[i]->priority;
+	}
+	
+	/* Reduce the lowest priority channels first, then mute them.
+	 * Channels above all others in priority are never muted, but
+	 * if every channel has the same priority any may be */
+	for(level = SHED_REDUCED; level <= SHED_MUTED; level++)
+	{
+		for(i = 0; i < s->nchannels; i++)
+		{
+			c = s->channels[i];
+			
+			if(atomic_load(&c->shed) >= level) continue;
+			if(level == SHED_REDUCED && !_shed_reduces(c)) continue;
+			if(level == SHED_MUTED && c->priority == top && top > bottom) continue;
+			
+			if(best == NULL || c->priority <= best->priority) best = c;
+		}
+		
+		if(best != NULL) break;
+	}
+	
+	if(best == NULL)
+	{
+		return;
+	}
+	
+	atomic_store(&best->shed, level);
+	
+	fprintf(stderr, "Shedding: Channel %d %s (load %.0f%%)\n",
+		best->index + 1,
+		level == SHED_MUTED ? "muted" : "reduced",
+		s->load * 100
+	);
+}
+
+static void _recover(struct satradio_t *s)
+{
+	struct satradio_channel_t *c, *best = NULL;
+	int i, level;
+	
+	/* Undo the last steps first, highest priority channels first */
+	for(level = SHED_MUTED; level >= SHED_REDUCED; level--)
+	{
+		for(i = 0; i < s->nchannels; i++)
+		{
+			c = s->channels[i];
+			
+			if(atomic_load(&c->shed) != level) continue;
+			
+			if(best == NULL || c->priority > best->priority) best = c;
+		}
+		
+		if(best != NULL) break;
+	}
+	
+	if(best == NULL)
+	{
+		return;
+	}
+	
+	level = (level == SHED_MUTED && _shed_reduces(best) ? SHED_REDUCED : SHED_NONE);
+	atomic_store(&best->shed, level);
+	
+	fprintf(stderr, "Shedding: Channel %d restored to %s (load %.0f%%)\n",
+		best->index + 1,
+		level == SHED_REDUCED ? "reduced quality" : "full quality",
+		s->load * 100
+	);
+}
+
+static void _shed_update(struct satradio_t *s, double elapsed)
+{
+	/* Track the time taken to render a block against its duration */
+	s->load += (elapsed * s->sample_rate / s->block_len - s->load) * 0.25;
+	
+	if(s->holdoff > 0)
+	{
+		s->holdoff--;
+	}
+	else if(s->load > SHED_HIGH)
+	{
+		_shed(s);
+		s->calm = 0;
+		s->holdoff = SHED_HOLDOFF;
+	}
+	else if(s->load < SHED_LOW)
+	{
+		if(++s->calm >= (int64_t) SHED_CALM * s->sample_rate / s->block_len)
+		{
+			_recover(s);
+			s->calm = 0;
+			s->holdoff = SHED_HOLDOFF;
+		}
+	}
+	else
+	{
+		s->calm = 0;
+	}
+}
+
+static void *_fm_thread(void *arg)
+{
+	struct satradio_t *s = arg;
+	const struct pipeline_block_t *comp;
+	struct pipeline_block_t *out;
+	const int16_t *in;
+	size_t size;
+	int x, len;
+	
+	size = rf_sample_size(&s->rf);
+	
+	while((comp = ring_read_acquire(&s->composite)) != NULL)
+	{
+		out = ring_write_acquire(&s->output);
+		if(out == NULL)
+		{
+			break;
+		}
+		
+		out->time = comp->time;
+		
+		/* FM modulate the composite a tile at a time */
+		for(x = 0; x < s->block_len; x += RANGE_SAMPLES)
+		{
+			len = s->block_len - x;
+			if(len > RANGE_SAMPLES) len = RANGE_SAMPLES;
+			
+			in = (const int16_t *) comp->data + x;
+			
+			_modulate_tile(s, out->data + x * size, in, s->fm_sample, s->fm_sum, len, s->iq);
+			
+			s->fm_sample += len;
+			s->fm_sum += _composite_sum(in, len);
+		}
+		
+		ring_read_release(&s->composite);
+		ring_write_commit(&s->output);
+	}
+	
+	/* Stop the stages either side of this one */
+	ring_close(&s->composite);
+	ring_close(&s->output);
+	
+	return(NULL);
+}
+
+static void *_sink_thread(void *arg)
+{
+	struct satradio_t *s = arg;
+	const struct pipeline_block_t *out;
+	double latency;
+	int64_t samples = 0;
+	int queued;
+	
+	while((out = ring_read_acquire(&s->output)) != NULL)
+	{
+		if(rf_write_native(&s->rf, out->data, s->block_len) != 0)
+		{
+			/* Stop the stages before this one */
+			ring_close(&s->output);
+			break;
+		}
+		
+		if(s->verbose && (samples += s->block_len) >= s->sample_rate)
+		{
+			/* Time since the composite block was started, plus
+			 * the time to clear anything still queued in the sink.
+			 * Buffering in the sources and any blocks the channel
+			 * threads have rendered ahead are not included */
+			latency = _time() - out->time;
+			queued = rf_queued(&s->rf);
+			if(queued > 0) latency += (double) queued / s->sample_rate;
+			
+			fprintf(stderr, "Latency: %.1f ms (composite to sink%s)\n",
+				latency * 1000.0,
+				queued < 0 ? ", sink queue unknown" : " output"
+			);
+			samples = 0;
+		}
+		
+		ring_read_release(&s->output);
+	}
+	
+	return(NULL);
+}
+
+static int _main_loop(struct satradio_t *s)
+{
+	struct pipeline_block_t *b;
+	const char *v;
+	int16_t *comp;
+	int64_t samples = 0;
+	int i, a, bl;
+	int r;
+	
+	bl = s->block_len;
+	
+	r = ring_init(&s->output, PIPELINE_SLOTS, sizeof(struct pipeline_block_t) + rf_sample_size(&s->rf) * bl);
+	
+	if(r == 0 && s->offline)
+	{
+		/* The workers modulate straight into the output blocks */
+		s->offline_comp = malloc(sizeof(int16_t) * bl);
+		if(!s->offline_comp) r = -1;
+	}
+	else if(r == 0)
+	{
+		r = ring_init(&s->composite, PIPELINE_SLOTS, sizeof(struct pipeline_block_t) + sizeof(int16_t) * bl);
+		
+		/* The modulator needs its own buffer if the output is converted */
+		if(r == 0 && s->rf.convert)
+		{
+			s->iq = malloc(sizeof(int16_t) * 2 * RANGE_SAMPLES);
+			if(!s->iq) r = -1;
+		}
+	}
+	
+	if(r != 0)
+	{
+		ring_free(&s->composite);
+		ring_free(&s->output);
+		free(s->offline_comp);
+		free(s->iq);
+		fprintf(stderr, "Out of memory.\n");
+		return(-1);
+	}
+	
+	r = pthread_create(&s->sink_thread, NULL, &_sink_thread, s);
+	if(r != 0)
+	{
+		ring_free(&s->composite);
+		ring_free(&s->output);
+		free(s->offline_comp);
+		free(s->iq);
+		fprintf(stderr, "Error: Failed to start output thread.\n");
+		return(-1);
+	}
+	
+	r = (s->offline ? 0 : pthread_create(&s->fm_thread, NULL, &_fm_thread, s));
+	if(r != 0)
+	{
+		/* Stop the output thread */
+		ring_close(&s->output);
+		pthread_join(s->sink_thread, NULL);
+		
+		ring_free(&s->composite);
+		ring_free(&s->output);
+		free(s->iq);
+		fprintf(stderr, "Error: Failed to start modulator thread.\n");
+		return(-1);
+	}
+	
+	if(_start_render(s) != 0)
+	{
+		_abort = 1;
+	}
+	else if(s->workers == 0 && s->threads && _start_channel_threads(s) != 0)
+	{
+		_abort = 1;
+	}
+	
+	/* Listen for commands. The socket is private to the
+	 * owner unless control_mode says otherwise */
+	v = conf_str(s->conf, NULL, -1, "control", NULL);
+	if(v != NULL && !_abort && control_open(&s->control, v, s->control_mode, _control, s) != 0)
+	{
+		_abort = 1;
+	}
+	
+	while(!_abort)
+	{
+		/* Offline, the block is the output itself */
+		b = ring_write_acquire(s->offline ? &s->output : &s->composite);
+		if(b == NULL)
+		{
+			break;
+		}
+		
+		/* Apply any change from the control socket */
+		if(atomic_load(&s->pending))
+		{
+			_apply_change(s);
+		}
+		
+		b->time = _time();
+		comp = (s->offline ? s->offline_comp : (int16_t *) b->data);
+		
+		/* Poll each active channel and render a block of the composite */
+		if(s->workers == 0 && s->threads)
+		{
+			a = _sum_channels(s, comp);
+		}
+		else
+		{
+			a = _render_channels(s, comp);
+		}
+		
+		if(s->verbose && (samples += bl) >= s->sample_rate)
+		{
+			fprintf(stderr, "Composite peak: %.1f dBFS, %" PRId64 " samples clipped\n",
+				20.0 * log10((s->stats.peak > 0 ? s->stats.peak : 1) / (double) INT16_MAX),
+				s->stats.clipped
+			);
+			
+			memset(&s->stats, 0, sizeof(struct bus_stats_t));
+			samples = 0;
+		}
+		
+		/* Drop any channels that ended in this block */
+		_channel_reap(s);
+		
+		/* End if there are no active stations */
+		if(a == 0) break;
+		
+		/* Step quality down or up to stay within the deadline */
+		if(s->shedding)
+		{
+			_shed_update(s, _time() - b->time);
+		}
+		
+		if(s->offline)
+		{
+			/* Modulate the block and pass it to the output thread */
+			_modulate_block(s, comp, b->data);
+			ring_write_commit(&s->output);
+		}
+		else
+		{
+			/* Pass the composite to the modulator thread */
+			ring_write_commit(&s->composite);
+		}
+	}
+	
+	_close_changes(s);
+	_stop_render(s);
+	
+	for(i = 0; i < s->nchannels; i++)
+	{
+		_stop_channel_thread(s->channels[i]);
+	}
+	
+	control_close(&s->control);
+	_channel_reap(s);
+	
+	/* Let the remaining blocks drain through the pipeline */
+	if(s->offline)
+	{
+		ring_close(&s->output);
+	}
+	else
+	{
+		ring_close(&s->composite);
+		pthread_join(s->fm_thread, NULL);
+	}
+	
+	pthread_join(s->sink_thread, NULL);
+	
+	ring_free(&s->composite);
+	ring_free(&s->output);
+	free(s->offline_comp);
+	free(s->iq);
+	
+	return(0);
+}
+
+int main(int argc, char *argv[])
+{
+	struct satradio_t s;
+	const char *conffile = NULL;
+	int c, option_index;
+	const struct option long_options[] = {
+		{ "version", no_argument,       0, 'v' },
+		{ "config",  required_argument, 0, 'c' },
+		{ "verbose", no_argument,       0, 'V' },
+		{ 0, 0, 0, 0 }
+	};
+	int i, r;
+	const char *v;
+	char *e;
+	double block_ms;
+	int buffer_ms;
 	
 #ifdef HAVE_FFMPEG
 	src_ffmpeg_init();
 #endif
 	
 	memset(&s, 0, sizeof(struct satradio_t));
+	pthread_mutex_init(&s.lock, NULL);
+	pthread_cond_init(&s.changed, NULL);
 	
 	opterr = 0;
 	while((c = getopt_long(argc, argv, "vc:V", long_options, &option_index)) != -1)
@@ -514,15 +2875,15 @@ int main(int argc, char *argv[])
 		case 'v': /* -v, --version */
 			fprintf(stderr, "satradio v0.2\n");
 			return(0);
-		
+			
 		case 'c': /* -c, --config <filename> */
 			conffile = optarg;
 			break;
-		
+			
 		case 'V': /* -V, --verbose */
 			s.verbose = 1;
 			break;
-		
+			
 		case '?':
 			print_usage();
 			return(0);
@@ -544,7 +2905,59 @@ int main(int argc, char *argv[])
 	}
 	
 	s.verbose = conf_bool(s.conf, NULL, -1, "verbose", s.verbose);
-	s.sample_rate = conf_double(s.conf, "output", -1, "sample_rate", 0),
+	s.sample_rate = conf_double(s.conf, "output", -1, "sample_rate", 0);
+	s.threads = conf_bool(s.conf, "output", -1, "threads", 0);
+	s.workers = conf_int(s.conf, "output", -1, "workers", 0);
+	
+	/* Offline rendering uses every core by default. The calling
+	 * thread works on the pool too, so one less worker is needed */
+	s.offline = conf_bool(s.conf, "output", -1, "offline", 0);
+	if(s.offline)
+	{
+		s.threads = 0;
+		s.workers = conf_int(s.conf, "output", -1, "workers", cpu_count() - 1);
+	}
+	
+	/* Block duration and sink buffering. The low latency profile
+	 * defaults to 5ms blocks and 20ms of buffering in the sink */
+	i = conf_bool(s.conf, "output", -1, "low_latency", 0);
+	block_ms = conf_double(s.conf, "output", -1, "block_ms", i ? 5 : 100);
+	buffer_ms = conf_double(s.conf, "output", -1, "buffer_ms", i ? 20 : 500);
+	
+	s.block_len = s.sample_rate * block_ms / 1000;
+	s.ranges = (s.block_len + RANGE_SAMPLES - 1) / RANGE_SAMPLES;
+	
+	if(s.block_len < 1 || buffer_ms < 1)
+	{
+		fprintf(stderr, "Error: Invalid block or buffer duration.\n");
+		return(-1);
+	}
+	
+	if(s.verbose)
+	{
+		fprintf(stderr, "Block size: %d samples (%.1f ms)\n", s.block_len, block_ms);
+	}
+	
+	if(s.workers < 0)
+	{
+		fprintf(stderr, "Error: Invalid number of workers.\n");
+		return(-1);
+	}
+	
+	/* Permissions of the control socket, in octal */
+	v = conf_str(s.conf, NULL, -1, "control_mode", "0600");
+	s.control_mode = strtol(v, &e, 8);
+	
+	if(*v == '\0' || *e != '\0' || s.control_mode < 0 || s.control_mode > 0777)
+	{
+		fprintf(stderr, "Error: Invalid control socket mode '%s'.\n", v);
+		return(-1);
+	}
+	
+	/* Channels added over the socket may only read files or run
+	 * commands if allowed here. exec implies input */
+	s.control_exec = conf_bool(s.conf, NULL, -1, "control_exec", 0);
+	s.control_input = s.control_exec || conf_bool(s.conf, NULL, -1, "control_input", 0);
 	
 	/* Catch all the signals */
 	signal(SIGINT, &_sigint_callback_handler);
@@ -554,226 +2967,29 @@ int main(int argc, char *argv[])
 	signal(SIGTERM, &_sigint_callback_handler);
 	signal(SIGABRT, &_sigint_callback_handler);
 	
+#ifndef _WIN32
+	/* A control client or output pipe closing early is
+	 * reported by the failed write, not by a signal */
+	signal(SIGPIPE, SIG_IGN);
+#endif
+	
 	/* Load configuration for each channel */
 	for(i = 0; conf_section_exists(s.conf, "channel", i); i++)
 	{
 		struct satradio_channel_t *ch;
 		
-		/* Enforce the channel limit */
-		if(i >= MAX_CHANNELS)
-		{
-			fprintf(stderr, "Warning: This version of satradio supports a maximum of %d channels.", MAX_CHANNELS);
-			break;
-		}
-		
-		ch = &s.channels[i];
-		ch->index = i;
-		
-		/* Configure the channel */
-		v = conf_str(s.conf, "channel", i, "mode", NULL);
-		if(v == NULL)
-		{
-			fprintf(stderr, "Error: No mode specified for channel %d.\n", i + 1);
-			return(-1);
-		}
-		else if(strcmp(v, "fm") == 0)
-		{
-			const double *taps = NULL;
-			
-			ch->mode = MODE_FM_MONO;
-			
-			v = conf_str(s.conf, "channel", i, "preemphasis", "none");
-			if(strcmp(v, "none") == 0)
-			{
-				taps = preemph_flat_taps;
-			}
-			else if(strcmp(v, "50us") == 0)
-			{
-				taps = preemph_50us_taps;
-			}
-			else if(strcmp(v, "75us") == 0)
-			{
-				taps = preemph_75us_taps;
-			}
-			else if(strcmp(v, "j17") == 0)
-			{
-				taps = preemph_j17_taps;
-			}
-			else
-			{
-				fprintf(stderr, "Error: Unrecognised pre-emphasis mode '%s' for channel %d.\n", v, i + 1);
-				return(-1);
-			}
-			
-			r = rf_fm_init(&ch->fm[0],
-				s.sample_rate,
-				conf_double(s.conf, "channel", i, "frequency", 0),
-				conf_double(s.conf, "channel", i, "deviation", 50e3),
-				conf_double(s.conf, "channel", i, "level", 1),
-				0 /* Real output */
-			);
-			
-			if(r != 0)
-			{
-				fprintf(stderr, "Error: Failed to initalise FM modulator for channel %d.\n", i + 1);
-				return(-1);
-			}
-			
-			r = limiter_init(&ch->limiter[0], INT16_MAX, 21, taps, preemph_flat_taps, PREEMPH_TAPS);
-			if(r != 0)
-			{
-				fprintf(stderr, "Error: Unable to initalise pre-emphasis filter for channel %d.\n", i + 1);
-				return(-1);
-			}
-			
-			ch->sample_rate = 32000;
-			ch->stereo = 0;
-			
-			/* Allocate memory for modulator output buffer */
-			r = ch->sample_rate / TWOLAME_SAMPLES_PER_FRAME;
-			r = (s.sample_rate + r - 1) / r;
-			ch->subcarrier = malloc(sizeof(int16_t) * 2 * r);
-			if(!ch->subcarrier)
-			{
-				fprintf(stderr, "Out of memory.\n");
-				return(-1);
-			}
-		}
-		else if(strcmp(v, "dual-fm") == 0)
-		{
-			const double *taps = NULL;
-			
-			ch->mode = MODE_FM_DUAL;
-			
-			v = conf_str(s.conf, "channel", i, "preemphasis", "none");
-			if(strcmp(v, "none") == 0)
-			{
-				taps = preemph_flat_taps;
-			}
-			else if(strcmp(v, "50us") == 0)
-			{
-				taps = preemph_50us_taps;
-			}
-			else if(strcmp(v, "75us") == 0)
-			{
-				taps = preemph_75us_taps;
-			}
-			else if(strcmp(v, "j17") == 0)
-			{
-				taps = preemph_j17_taps;
-			}
-			else
-			{
-				fprintf(stderr, "Error: Unrecognised pre-emphasis mode '%s' for channel %d.\n", v, i + 1);
-				return(-1);
-			}
-			
-			for(c = 0; c < 2; c++)
-			{
-				r = rf_fm_init(&ch->fm[c],
-					s.sample_rate,
-					conf_double(s.conf, "channel", i, c == 0 ? "frequency1" : "frequency2", 0),
-					conf_double(s.conf, "channel", i, "deviation", 50e3),
-					conf_double(s.conf, "channel", i, "level", 1),
-					0 /* Real output */
-				);
-				
-				if(r != 0)
-				{
-					fprintf(stderr, "Error: Failed to initalise FM modulator for channel %d.\n", i + 1);
-					return(-1);
-				}
-				
-				r = limiter_init(&ch->limiter[c], INT16_MAX, 21, taps, preemph_flat_taps, PREEMPH_TAPS);
-				if(r != 0)
-				{
-					fprintf(stderr, "Error: Unable to initalise pre-emphasis filter for channel %d.\n", i + 1);
-					return(-1);
-				}
-			}
-			
-			ch->sample_rate = 32000;
-			ch->stereo = 1;
-			
-			/* Allocate memory for modulator output buffer */
-			r = ch->sample_rate / TWOLAME_SAMPLES_PER_FRAME;
-			r = (s.sample_rate + r - 1) / r;
-			ch->subcarrier = malloc(sizeof(int16_t) * 2 * r);
-			ch->subcarrier2 = malloc(sizeof(int16_t) * 2 * r);
-			if(!ch->subcarrier || !ch->subcarrier2)
-			{
-				fprintf(stderr, "Out of memory.\n");
-				return(-1);
-			}
-		}
-		else if(strcmp(v, "adr") == 0)
+		ch = _channel_new(&s, s.conf, i);
+		if(ch == NULL || _channel_insert(&s, ch) != 0)
 		{
-			TWOLAME_MPEG_mode mode;
-			
-			ch->mode = MODE_ADR;
-			
-			v = conf_str(s.conf, "channel", i, "adr_mode", "joint");
-			if(strcmp("mono", v) == 0) mode = TWOLAME_MONO;
-			else if(strcmp("dual", v) == 0) mode = TWOLAME_DUAL_CHANNEL;
-			else if(strcmp("joint", v) == 0) mode = TWOLAME_JOINT_STEREO;
-			else if(strcmp("stereo", v) == 0) mode = TWOLAME_STEREO;
-			else
-			{
-				fprintf(stderr, "Error: Unrecognised ADR mode '%s' for channel %d.\n", v, i + 1);
-				return(-1);
-			}
-			
-			/* Initalise ADR encoder */
-			r = adr_init(&ch->adr, mode, conf_bool(s.conf, "channel", i, "scfcrc", 1));
-			if(r != 0)
-			{
-				fprintf(stderr, "Error: ADR encoder failed to initalise for channel %d.\n", i + 1);
-				return(-1);
-			}
-			
-			/* Set the channel name */
-			adr_set_station_id(&ch->adr, conf_str(s.conf, "channel", i, "name", ""));
-			
-			/* Initalise QPSK modulator and mixer */
-			r = rf_gcd(s.sample_rate, ADR_SYMBOL_RATE);
-			
-			rf_qpsk_init(&ch->qpsk, s.sample_rate / r, ADR_SYMBOL_RATE / r, 1);
-			
-			rf_mixer_init(&ch->mixer, s.sample_rate,
-				conf_double(s.conf, "channel", i, "frequency", 0),
-				conf_double(s.conf, "channel", i, "level", 1),
-				0 /* Real output */
-			);
-			
-			ch->sample_rate = ADR_SAMPLE_RATE;
-			ch->stereo = (mode == TWOLAME_MONO ? 0 : 1);
-			
-			/* Allocate memory for modulator output buffer */
-			r = ch->sample_rate / TWOLAME_SAMPLES_PER_FRAME;
-			r = (s.sample_rate + r - 1) / r;
-			ch->subcarrier = malloc(sizeof(int16_t) * 2 * r);
-			if(!ch->subcarrier)
-			{
-				fprintf(stderr, "Out of memory.\n");
-				return(-1);
-			}
-		}
-		else
-		{
-			fprintf(stderr, "Error: Unsupported channel mode '%s' for channel %d.", v, i + 1);
+			fprintf(stderr, "Out of memory.\n");
 			return(-1);
 		}
 		
-		/* Open the audio source */
-		ch->repeat = conf_bool(s.conf, "channel", i, "repeat", 0);
-		
-		r = _channel_src_open(&s, i);
+		r = _channel_init(&s, ch);
 		if(r != 0)
 		{
 			return(-1);
 		}
-		
-		ch->active = 1;
 	}
 	
 	/* Start the radio / output */
@@ -785,6 +3001,12 @@ int main(int argc, char *argv[])
 		return(-1);
 	}
 	
+	if(s.offline && (strcmp(v, "file") != 0 || conf_bool(s.conf, "output", -1, "live", 0)))
+	{
+		fprintf(stderr, "Error: Offline rendering is only possible to a file that isn't live.\n");
+		return(-1);
+	}
+	
 	if(strcmp(v, "file") == 0)
 	{
 		i = -1;
@@ -821,7 +3043,8 @@ int main(int argc, char *argv[])
 			s.sample_rate,
 			conf_double(s.conf, "output", -1, "frequency", 0),
 			conf_double(s.conf, "output", -1, "gain", 0),
-			conf_bool(s.conf, "output", -1, "amp", 0)
+			conf_bool(s.conf, "output", -1, "amp", 0),
+			buffer_ms
 		);
 		
 		if(r != 0)
@@ -853,7 +3076,7 @@ int main(int argc, char *argv[])
 		return(-1);
 	}
 	
-	/* Configure output FM modulator (100ms blocks) */
+	/* Configure output FM modulator */
 	rf_fm_init(&s.fm,
 		s.sample_rate,
 		0, /* No frequency offset */
@@ -862,6 +3085,9 @@ int main(int argc, char *argv[])
 		1 /* Complex output */
 	);
 	
+	/* Shedding only applies when there is a deadline to keep */
+	s.shedding = conf_bool(s.conf, "output", -1, "shedding", 0) && rf_live(&s.rf);
+	
 	_main_loop(&s);
 	
 	/* Close the output */